@@ -0,0 +1,82 @@
+/*
+ * GTA04 gsm voice routing utility
+ * Copyright (c) 2012 Radek Polak
+ *
+ * gta04-gsm-voice-routing is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * gta04-gsm-voice-routing is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with gta04-gsm-voice-routing; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "arena.h"
+
+int arena_init(struct arena *a, size_t size)
+{
+    long page = sysconf(_SC_PAGESIZE);
+
+    if (page <= 0) {
+        page = 4096;
+    }
+    a->size = (size + page - 1) & ~(size_t)(page - 1);
+    a->used = 0;
+    if (posix_memalign((void **)&a->base, page, a->size)) {
+        a->base = 0;
+        return -1;
+    }
+
+    /* Lock first so that touching it faults everything in now */
+    a->locked = mlock(a->base, a->size) == 0;
+    memset(a->base, 0, a->size);
+    return 0;
+}
+
+void arena_destroy(struct arena *a)
+{
+    if (a->base == 0) {
+        return;
+    }
+    if (a->locked) {
+        munlock(a->base, a->size);
+    }
+    free(a->base);
+    a->base = 0;
+    a->size = 0;
+    a->used = 0;
+}
+
+void *arena_alloc(struct arena *a, size_t size)
+{
+    void *ptr;
+
+    if (a == 0) {
+        return calloc(1, size);
+    }
+    if (a->size - a->used < ARENA_BLOCK(size)) {
+        return 0;
+    }
+    ptr = a->base + a->used;
+    a->used += ARENA_BLOCK(size);
+    memset(ptr, 0, size);
+    return ptr;
+}
+
+void arena_free(struct arena *a, void *ptr)
+{
+    if (a == 0) {
+        free(ptr);
+    }
+}
@@ -0,0 +1,63 @@
+/*
+ * GTA04 gsm voice routing utility
+ * Copyright (c) 2012 Radek Polak
+ *
+ * gta04-gsm-voice-routing is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * gta04-gsm-voice-routing is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with gta04-gsm-voice-routing; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/*
+
+Preallocated memory for period buffers, rings and DSP scratch areas.
+
+One block is allocated at startup, sized from the configured geometry. It's
+page aligned, locked in memory and touched once, so nothing on the routing
+path allocates or page faults. Blocks taken from it are cache line aligned
+and zeroed. They are never freed one by one - objects keep their blocks and
+reuse them for the next call, the whole arena is released at exit.
+
+All functions accept arena 0, then plain calloc() and free() are used, e.g.
+by gsm-voice-routing-bench.
+
+*/
+
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+/* Cache line size of Cortex-A8 is 64 bytes */
+#define ARENA_ALIGN 64
+
+struct arena
+{
+    char *base;                 // page aligned block
+    size_t size;                // bytes in block
+    size_t used;                // bytes already taken
+    int locked;                 // mlock() succeeded
+};
+
+/* Bytes taken from arena for block of given size */
+#define ARENA_BLOCK(size) (((size) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1))
+
+int arena_init(struct arena *a, size_t size);
+void arena_destroy(struct arena *a);
+
+/* Zeroed block or 0 if arena is exhausted */
+void *arena_alloc(struct arena *a, size_t size);
+
+/* Only frees blocks that came from calloc(), i.e. when arena is 0 */
+void arena_free(struct arena *a, void *ptr);
+
+#endif
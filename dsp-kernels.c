@@ -0,0 +1,173 @@
+/*
+ * GTA04 gsm voice routing utility
+ * Copyright (c) 2012 Radek Polak
+ *
+ * gta04-gsm-voice-routing is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * gta04-gsm-voice-routing is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with gta04-gsm-voice-routing; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <string.h>
+
+#if defined(__ARM_NEON__) || defined(__ARM_NEON)
+#define DSP_NEON
+#include <arm_neon.h>
+#endif
+
+#include "dsp-kernels.h"
+
+static inline short saturate(int val)
+{
+    if (val > 32767) {
+        return 32767;
+    }
+    if (val < -32768) {
+        return -32768;
+    }
+    return val;
+}
+
+void dsp_gain(short *buf, int count, int gain)
+{
+    int i = 0;
+
+    if (gain > DSP_GAIN_MAX) {
+        gain = DSP_GAIN_MAX;
+    } else if (gain < 0) {
+        gain = 0;
+    }
+
+#ifdef DSP_NEON
+    int16x4_t g = vdup_n_s16(gain);
+    for (; i + 8 <= count; i += 8) {
+        int16x8_t x = vld1q_s16(buf + i);
+        int32x4_t lo = vmull_s16(vget_low_s16(x), g);
+        int32x4_t hi = vmull_s16(vget_high_s16(x), g);
+        vst1q_s16(buf + i, vcombine_s16(vqrshrn_n_s32(lo, DSP_GAIN_SHIFT),
+                                        vqrshrn_n_s32(hi, DSP_GAIN_SHIFT)));
+    }
+#endif
+
+    for (; i < count; i++) {
+        buf[i] = saturate((buf[i] * gain + (1 << (DSP_GAIN_SHIFT - 1))) >>
+                          DSP_GAIN_SHIFT);
+    }
+}
+
+static inline int clamp_gain(int gain)
+{
+    if (gain > DSP_GAIN_MAX) {
+        return DSP_GAIN_MAX;
+    }
+    if (gain < 0) {
+        return 0;
+    }
+    return gain;
+}
+
+void dsp_gain_ramp(short *buf, int count, int gain_from, int gain_to)
+{
+    int i = 0;
+    int gain;
+    int step;                   // gain change per sample, Q16 fraction
+
+    gain_from = clamp_gain(gain_from);
+    gain_to = clamp_gain(gain_to);
+    if (count <= 0) {
+        return;
+    }
+    step = (gain_to - gain_from) * 65536 / count;
+    gain = gain_from * 65536;
+
+#ifdef DSP_NEON
+    int32x4_t g = { gain, gain + step, gain + 2 * step, gain + 3 * step };
+    int32x4_t g_step = vdupq_n_s32(4 * step);
+    for (; i + 4 <= count; i += 4) {
+        int32x4_t x = vmovl_s16(vld1_s16(buf + i));
+        int32x4_t y = vmulq_s32(x, vshrq_n_s32(g, 16));
+        vst1_s16(buf + i, vqrshrn_n_s32(y, DSP_GAIN_SHIFT));
+        g = vaddq_s32(g, g_step);
+    }
+    gain += i * step;
+#endif
+
+    for (; i < count; i++, gain += step) {
+        buf[i] = saturate((buf[i] * (gain >> 16) +
+                           (1 << (DSP_GAIN_SHIFT - 1))) >> DSP_GAIN_SHIFT);
+    }
+}
+
+void dsp_mix(short *dst, const short *src, int count)
+{
+    int i = 0;
+
+#ifdef DSP_NEON
+    for (; i + 8 <= count; i += 8) {
+        vst1q_s16(dst + i, vqaddq_s16(vld1q_s16(dst + i), vld1q_s16(src + i)));
+    }
+#endif
+
+    for (; i < count; i++) {
+        dst[i] = saturate(dst[i] + src[i]);
+    }
+}
+
+void dsp_silence(short *buf, int count)
+{
+    /* libc memset is already as fast as it gets */
+    memset(buf, 0, count * sizeof(short));
+}
+
+unsigned int dsp_sum_abs(const short *buf, int count)
+{
+    unsigned int sum = 0;
+    int i = 0;
+
+#ifdef DSP_NEON
+    uint32x4_t acc = vdupq_n_u32(0);
+    uint64x2_t acc64;
+    for (; i + 8 <= count; i += 8) {
+        /* saturating abs, so that -32768 does not stay negative */
+        int16x8_t x = vqabsq_s16(vld1q_s16(buf + i));
+        acc = vpadalq_u16(acc, vreinterpretq_u16_s16(x));
+    }
+    acc64 = vpaddlq_u32(acc);
+    sum = vgetq_lane_u64(acc64, 0) + vgetq_lane_u64(acc64, 1);
+#endif
+
+    for (; i < count; i++) {
+        sum += buf[i] < 0 ? -buf[i] : buf[i];
+    }
+    return sum;
+}
+
+unsigned long long dsp_energy(const short *buf, int count)
+{
+    unsigned long long sum = 0;
+    int i = 0;
+
+#ifdef DSP_NEON
+    int64x2_t acc = vdupq_n_s64(0);
+    for (; i + 8 <= count; i += 8) {
+        int16x8_t x = vld1q_s16(buf + i);
+        acc = vpadalq_s32(acc, vmull_s16(vget_low_s16(x), vget_low_s16(x)));
+        acc = vpadalq_s32(acc, vmull_s16(vget_high_s16(x), vget_high_s16(x)));
+    }
+    sum = vgetq_lane_s64(acc, 0) + vgetq_lane_s64(acc, 1);
+#endif
+
+    for (; i < count; i++) {
+        sum += buf[i] * buf[i];
+    }
+    return sum;
+}
@@ -0,0 +1,58 @@
+/*
+ * GTA04 gsm voice routing utility
+ * Copyright (c) 2012 Radek Polak
+ *
+ * gta04-gsm-voice-routing is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * gta04-gsm-voice-routing is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with gta04-gsm-voice-routing; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/*
+
+Small fixed point kernels for S16 mono periods. NEON versions are used when
+compiled for ARM with NEON (e.g. -mfpu=neon for Cortex-A8 in GTA04), portable
+C versions otherwise and for the remaining samples that do not fill whole
+NEON vector.
+
+Gains are in Q12 fixed point, i.e. DSP_GAIN_ONE (4096) is 1.0 and max gain is
+almost 8.0. All results are saturated instead of wrapping.
+
+*/
+
+#ifndef DSP_KERNELS_H
+#define DSP_KERNELS_H
+
+#define DSP_GAIN_SHIFT 12
+#define DSP_GAIN_ONE (1 << DSP_GAIN_SHIFT)
+#define DSP_GAIN_MAX 32767
+
+/* buf = buf * gain */
+void dsp_gain(short *buf, int count, int gain);
+
+/* buf = buf * gain, gain goes linearly from gain_from for the first sample
+   towards gain_to (reached after the last one) */
+void dsp_gain_ramp(short *buf, int count, int gain_from, int gain_to);
+
+/* dst = dst + src */
+void dsp_mix(short *dst, const short *src, int count);
+
+/* buf = 0 */
+void dsp_silence(short *buf, int count);
+
+/* Sum of absolute values */
+unsigned int dsp_sum_abs(const short *buf, int count);
+
+/* Sum of squares */
+unsigned long long dsp_energy(const short *buf, int count);
+
+#endif
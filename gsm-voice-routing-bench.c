@@ -0,0 +1,359 @@
+/*
+ * GTA04 gsm voice routing utility
+ * Copyright (c) 2012 Radek Polak
+ *
+ * gta04-gsm-voice-routing is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * gta04-gsm-voice-routing is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with gta04-gsm-voice-routing; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/*
+
+Offline benchmark of gsm-voice-routing sound processing.
+
+Reads recorded near end (what microphone recorded) and far end (what was
+played on speaker) audio and pushes it period by period through the same
+processing stages (voice-processing.c) gsm-voice-routing uses during the
+call: far end goes through downlink level stages as it would before it is
+played, then both go through echo suppression (duplex processing for
+backends which have it, like single thread mode does) and uplink level
+stages. All of it is timed. Files are S16_LE mono 8000Hz, either WAV or
+raw.
+
+Usage:
+
+gsm-voice-routing-bench [-p period_size] [-o out.raw] [-m cpu_mhz]
+                        [-b backend] [-f aec_frame] [-t aec_tail] [-n]
+                        [-a percent] [-v] [-g agc_level] [-c noise_level]
+                        near far
+
+At the end, histogram of time spent processing one period is printed together
+with realtime factor (how many times faster than realtime the processing is).
+With -m cpu_mhz the times are shown also in cpu cycles. Processed uplink can
+be saved with -o as raw S16_LE so that the result can be listened to.
+
+-b selects echo suppression backend (none, walkie, speex or
+speex-preprocess) like GSM_VOICE_ROUTING_AEC. -f, -t, -n and -a select echo
+canceller frame size, tail length, preprocessor and auto tail as
+GSM_VOICE_ROUTING_AEC_* variables do for gsm-voice-routing. -v bypasses the
+canceller while far end is silent like GSM_VOICE_ROUTING_VAD, share of
+bypassed frames is printed. -g and -c turn
+on automatic gain control and comfort noise of both directions like
+GSM_VOICE_ROUTING_AGC and GSM_VOICE_ROUTING_COMFORT_NOISE.
+
+*/
+
+#include <time.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "voice-processing.h"
+
+/* Number of power of two histogram buckets, starting with <1us */
+#define HIST_BUCKETS 24
+
+/* Read little endian integers from WAV header */
+static unsigned int le16(const unsigned char *p)
+{
+    return p[0] | (p[1] << 8);
+}
+
+static unsigned int le32(const unsigned char *p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned int)p[3] << 24);
+}
+
+/* Read whole file into memory. If it's WAV file, only samples from data chunk
+   are returned. Returns number of samples or -1 on error. */
+static long read_audio(const char *path, s16 **samples)
+{
+    FILE *f;
+    unsigned char *data;
+    unsigned char *pos;
+    unsigned char *end;
+    unsigned int chunk_size;
+    long size;
+
+    f = fopen(path, "rb");
+    if (f == 0) {
+        fprintf(stderr, "failed to open %s\n", path);
+        return -1;
+    }
+    fseek(f, 0, SEEK_END);
+    size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    data = (unsigned char *)malloc(size > 0 ? size : 1);
+    if (data == 0 || fread(data, 1, size, f) != (size_t) size) {
+        fprintf(stderr, "failed to read %s\n", path);
+        fclose(f);
+        free(data);
+        return -1;
+    }
+    fclose(f);
+
+    /* Raw S16 */
+    if (size < 12 || memcmp(data, "RIFF", 4) || memcmp(data + 8, "WAVE", 4)) {
+        *samples = (s16 *) data;
+        return size / 2;
+    }
+
+    pos = data + 12;
+    end = data + size;
+    while (pos + 8 <= end) {
+        chunk_size = le32(pos + 4);
+        if (memcmp(pos, "fmt ", 4) == 0 && pos + 24 <= end) {
+            if (le16(pos + 8) != 1 || le16(pos + 10) != 1 ||
+                le16(pos + 22) != 16) {
+                fprintf(stderr, "%s: only 16bit mono PCM is supported\n",
+                        path);
+                free(data);
+                return -1;
+            }
+            if (le32(pos + 12) != 8000) {
+                fprintf(stderr, "%s: warning, rate is %u, not 8000\n", path,
+                        le32(pos + 12));
+            }
+        } else if (memcmp(pos, "data", 4) == 0) {
+            if (chunk_size > end - pos - 8) {
+                chunk_size = end - pos - 8;
+            }
+            memmove(data, pos + 8, chunk_size);
+            *samples = (s16 *) data;
+            return chunk_size / 2;
+        }
+        pos += 8 + chunk_size + (chunk_size & 1);
+    }
+
+    fprintf(stderr, "%s: no data chunk\n", path);
+    free(data);
+    return -1;
+}
+
+static long long now_ns()
+{
+    struct timespec tp;
+    clock_gettime(CLOCK_MONOTONIC_RAW, &tp);
+    return tp.tv_sec * 1000000000LL + tp.tv_nsec;
+}
+
+static int compare_ll(const void *a, const void *b)
+{
+    long long x = *(const long long *)a;
+    long long y = *(const long long *)b;
+    return x < y ? -1 : x > y;
+}
+
+/* Voice processing reports its changes here */
+static void log_stderr(const char *fmt, ...)
+{
+    va_list ap;
+
+    va_start(ap, fmt);
+    vfprintf(stderr, fmt, ap);
+    va_end(ap);
+}
+
+static void usage()
+{
+    fprintf(stderr, "usage: gsm-voice-routing-bench [-p period_size] "
+            "[-o out.raw] [-m cpu_mhz] [-b backend] [-f aec_frame] "
+            "[-t aec_tail] [-n] [-a percent] [-v] [-g agc_level] "
+            "[-c noise_level] near far\n");
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    struct voice_processing vp;
+    struct voice_processing_config config;
+    int period_size = 256;
+    const char *out_path = 0;
+    FILE *out_file = 0;
+    double mhz = 0;
+    s16 *near;
+    s16 *far;
+    s16 *far_copy;
+    s16 *out;
+    long near_count;
+    long far_count;
+    long periods;
+    long long *times;
+    long long total = 0;
+    long long start;
+    unsigned int hist[HIST_BUCKETS];
+    char label[32];
+    double period_us;
+    double us;
+    long i;
+    int bucket;
+    int opt;
+    int j;
+
+    memset(&config, 0, sizeof(config));
+    while ((opt = getopt(argc, argv, "p:o:m:b:f:t:na:vg:c:")) != -1) {
+        switch (opt) {
+        case 'b':
+            config.backend = optarg;
+            break;
+        case 'f':
+            config.frame_size = atoi(optarg);
+            break;
+        case 't':
+            config.tail = atoi(optarg);
+            break;
+        case 'n':
+            config.preprocess = 1;
+            break;
+        case 'a':
+            config.auto_tail = atoi(optarg);
+            break;
+        case 'v':
+            config.vad = 1;
+            break;
+        case 'g':
+            config.agc = atoi(optarg);
+            break;
+        case 'c':
+            config.comfort_noise = atoi(optarg);
+            break;
+        case 'p':
+            period_size = atoi(optarg);
+            break;
+        case 'o':
+            out_path = optarg;
+            break;
+        case 'm':
+            mhz = atof(optarg);
+            break;
+        default:
+            usage();
+        }
+    }
+    if (argc - optind != 2 || period_size <= 0) {
+        usage();
+    }
+
+    near_count = read_audio(argv[optind], &near);
+    far_count = read_audio(argv[optind + 1], &far);
+    if (near_count < 0 || far_count < 0) {
+        return 1;
+    }
+    periods = (near_count < far_count ? near_count : far_count) / period_size;
+    if (periods == 0) {
+        fprintf(stderr, "input is shorter than one period\n");
+        return 1;
+    }
+
+    if (out_path) {
+        out_file = fopen(out_path, "wb");
+        if (out_file == 0) {
+            fprintf(stderr, "failed to open %s\n", out_path);
+            return 1;
+        }
+    }
+
+    far_copy = (s16 *) malloc(period_size * sizeof(s16));
+    out = (s16 *) malloc(period_size * sizeof(s16));
+    times = (long long *)malloc(periods * sizeof(long long));
+    if (far_copy == 0 || out == 0 || times == 0) {
+        fprintf(stderr, "alloc failed\n");
+        return 1;
+    }
+    if (voice_processing_init(&vp, period_size, &config, 0, log_stderr)) {
+        fprintf(stderr, "voice processing init failed\n");
+        return 1;
+    }
+
+    for (i = 0; i < periods; i++) {
+        /* Far end can be modified by processing */
+        memcpy(far_copy, far + i * period_size, period_size * sizeof(s16));
+        start = now_ns();
+        voice_processing_swap(&vp);
+        voice_processing_downlink(&vp, far_copy);
+        if (vp.backend->duplex) {
+            memcpy(out, near + i * period_size, period_size * sizeof(s16));
+            voice_processing_duplex(&vp, far_copy, out);
+        } else {
+            voice_processing_uplink(&vp, near + i * period_size, far_copy,
+                                    out);
+        }
+        times[i] = now_ns() - start;
+
+        /* Shorter auto_tail canceller is built outside of the timing, like
+           control thread of gsm-voice-routing does */
+        voice_processing_maintain(&vp);
+        total += times[i];
+        if (out_file) {
+            fwrite(out, sizeof(s16), period_size, out_file);
+        }
+    }
+
+    if (vp.vad_frames) {
+        printf("canceller bypassed: %u of %u frames (%.1f%%)\n",
+               vp.vad_bypassed, vp.vad_frames,
+               vp.vad_bypassed * 100.0 / vp.vad_frames);
+    }
+    voice_processing_destroy(&vp);
+    if (out_file) {
+        fclose(out_file);
+    }
+
+    /* Histogram with power of two buckets in us */
+    memset(hist, 0, sizeof(hist));
+    for (i = 0; i < periods; i++) {
+        us = times[i] / 1000.0;
+        for (bucket = 0; bucket < HIST_BUCKETS - 1 && us >= (1 << bucket);
+             bucket++) {
+        }
+        hist[bucket]++;
+    }
+    qsort(times, periods, sizeof(long long), compare_ll);
+
+    period_us = period_size * 1000000.0 / 8000;
+    printf("periods: %ld of %d frames (%.2f ms)\n", periods, period_size,
+           period_us / 1000);
+    printf("time per period us: min %.1f avg %.1f p50 %.1f p99 %.1f max %.1f\n",
+           times[0] / 1000.0, total / 1000.0 / periods,
+           times[periods / 2] / 1000.0, times[periods * 99 / 100] / 1000.0,
+           times[periods - 1] / 1000.0);
+    if (mhz > 0) {
+        printf("cycles per period: avg %.0f p99 %.0f max %.0f\n",
+               total / 1000.0 / periods * mhz,
+               times[periods * 99 / 100] / 1000.0 * mhz,
+               times[periods - 1] / 1000.0 * mhz);
+    }
+    printf("realtime factor: %.1f (%.1f%% of period)\n",
+           periods * period_us * 1000 / total,
+           total / 1000.0 / periods * 100 / period_us);
+
+    printf("histogram:\n");
+    for (j = 0; j < HIST_BUCKETS; j++) {
+        if (hist[j] == 0) {
+            continue;
+        }
+        if (j == 0) {
+            snprintf(label, sizeof(label), "<1");
+        } else if (j == HIST_BUCKETS - 1) {
+            snprintf(label, sizeof(label), "%d+", 1 << (j - 1));
+        } else {
+            snprintf(label, sizeof(label), "%d-%d", 1 << (j - 1), 1 << j);
+        }
+        printf("  %16s us %8u %5.1f%%\n", label, hist[j],
+               hist[j] * 100.0 / periods);
+    }
+
+    return 0;
+}
@@ -37,8 +37,29 @@ r1 - record from hw:1,0 umts sound card
 p0 - play on hw:0,0 (default) internal sound card
 p1 - play on hw:1,0 umts sound card
 
-All streams have rate 8000 (rate of umts sound card), 1 channel and 16bit per
-sample (SND_PCM_FORMAT_S16_LE).
+r0 and p0 are opened on the local endpoint, which is internal card by
+default. Other endpoints (headset, usb card, bluetooth sco pcm) are listed
+in GSM_VOICE_ROUTING_ENDPOINTS as space separated name=pcm pairs, e.g.
+"handset=default headset=hw:2,0 bt=bluealsa", the first one is used unless
+GSM_VOICE_ROUTING_ENDPOINT=name says otherwise. Endpoint can be switched
+mid-call from control socket (see below): routing stops at period boundary,
+only r0 and p0 are closed and opened on the new endpoint (or back on the
+old one if it fails) and routing continues while umts streams stay open, so
+the switch costs one device open instead of whole call setup. Echo
+canceller is reset as the acoustic path is different. Card format
+(GSM_VOICE_ROUTING_R0_* and P0_*) is the same for all endpoints, use plug
+devices for endpoints which need something else. Modem pcm can be changed
+with GSM_VOICE_ROUTING_MODEM (hw:1,0 by default).
+
+All processing is done at rate 8000 (rate of umts sound card), 1 channel and
+16bit per sample (SND_PCM_FORMAT_S16_LE). A card which wants something else
+is configured per stream with GSM_VOICE_ROUTING_<STREAM>_RATE (multiple of
+8000), GSM_VOICE_ROUTING_<STREAM>_FORMAT (S16_LE, S24_LE or S32_LE) and
+GSM_VOICE_ROUTING_<STREAM>_CHANNELS, e.g. GSM_VOICE_ROUTING_P0_RATE=48000.
+The stream then converts at read/write: recording takes the first channel and
+is resampled down to 8000, playback is resampled up and written to all
+channels. Periods and buffers are always in 8000Hz frames, the card gets
+correspondingly more. mmap access is not used for converted streams.
 
 We set buffer_size of sound card to 1024.
 The sound card buffer consists of 4 periods.
@@ -49,28 +70,218 @@ We always play/record one period (256 samples, 512 bytes). At rate 8000Hz if
 we had 8000 samples it would be 1s, with 256 samples it makes 31.25ms long
 period - this is our latency.
 
+The geometry can be changed with GSM_VOICE_ROUTING_PERIOD_SIZE and
+GSM_VOICE_ROUTING_BUFFER_SIZE environment variables (in frames, buffer
+defaults to 4 periods), e.g. period 80 frames makes 10ms latency. If the card
+does not support exact values, nearest supported ones are used. The umts card
+is opened first and the geometry it negotiated is then requested for the
+other streams and start/stop thresholds.
+
+By default everything is done in one thread: read r0, read r1, write p0 and
+write p1. Stall on any of the cards thus stalls both directions. When
+GSM_VOICE_ROUTING_MODE=threads is set in environment, the directions are
+routed by two independent threads instead:
+
+uplink   - r0 -> echo cancellation -> p1
+downlink - r1 -> p0
+
+The only thing they share is the echo reference (what was played on p0),
+which downlink thread passes to uplink thread through lock-free single
+producer/single consumer ring, so that none of the threads ever waits for
+the other.
+
+With GSM_VOICE_ROUTING_MODE=poll all four streams are opened non-blocking and
+serviced from one poll() loop - each stream as soon as it is ready, so the
+slower card does not dictate the order for the other one. A period which
+can't be played right away waits in the stream's period buffer until the
+playback stream is ready again (newer period replaces it).
+
+GSM_VOICE_ROUTING_MMAP=1 switches all streams to mmap access. Period buffer
+of a stream then points directly into the DMA area of the sound card, so echo
+cancellation reads what r0 recorded and writes straight where p1 plays it,
+without copying through intermediate buffers. When period wraps around the
+end of the sound card buffer, the stream's own buffer is used instead.
+
+Internal card and umts modem run from different clocks, so on long calls one
+of the playback streams slowly fills up (latency grows, then the capture
+overruns) or drains (underruns). GSM_VOICE_ROUTING_DRIFT_COMP=1 enables drift
+compensation: the level of each playback stream (snd_pcm_delay() plus frames
+waiting to be played) is watched over time and the period is resampled by
+speex resampler with ratio slightly off 1.0 so that the level stays at target.
+The target is the level at the beginning of the call or
+GSM_VOICE_ROUTING_DRIFT_TARGET frames. Single thread mode reads one period
+from each capture per loop, so the faster capture piles up in its buffer
+instead; when it gets DRIFT_CAPTURE_AHEAD periods ahead of the other one, one
+of its periods is dropped.
+
+GSM_VOICE_ROUTING_JITTER_TARGET_MS puts a jitter buffer in front of both
+playback streams. Playing starts once it holds the target amount of audio
+and it never grows over GSM_VOICE_ROUTING_JITTER_MAX_MS (the oldest periods
+are dropped). When a period is missing (short read, overrun) the last period
+is repeated with decreasing volume instead, so late or lost period does not
+make audible dropout. If the buffer stays above target for a while, one
+period is dropped to keep latency at target.
+
+nice(-20) is not enough to keep the routing from being preempted on loaded
+phone. GSM_VOICE_ROUTING_RT_PRIORITY=1..99 runs routing thread(s) with
+SCHED_FIFO (or SCHED_RR with GSM_VOICE_ROUTING_RT_POLICY=rr) at given
+priority, locks all memory with mlockall() and prefaults the stack, so that
+page faults do not cause xruns. GSM_VOICE_ROUTING_CPU pins the routing
+thread(s) to given cpu. If we don't have permissions for any of it, it's
+logged and we continue without it.
+
+Echo suppression backend is selected by GSM_VOICE_ROUTING_AEC=none, walkie,
+speex (default) or speex-preprocess, all are compiled in. In single thread
+mode walkie ducks the playback together with the record, in the other modes
+it only adjusts the uplink. Speex echo canceller is configured with
+GSM_VOICE_ROUTING_AEC_FRAME (frame size, independent of period, defaults to
+period size or its multiple of at least 10ms), GSM_VOICE_ROUTING_AEC_TAIL
+(filter length in frames, 2048 by default),
+GSM_VOICE_ROUTING_AEC_PREPROCESS=1 (denoise and residual echo suppression,
+same as speex-preprocess) and GSM_VOICE_ROUTING_AEC_AUTO_TAIL=percent
+(shorten the tail when processing takes more than that percent of period,
+the shorter canceller is built by control thread).
+With GSM_VOICE_ROUTING_VAD=1 the canceller is not run (nor adapts) while
+the echo reference is silent, which is most of a typical call, and the share
+of bypassed frames is logged at hangup. See voice-processing.h.
+
+Both directions can be levelled by the stages after echo suppression:
+GSM_VOICE_ROUTING_AGC=level turns on automatic gain control towards given
+mean absolute sample (e.g. 2000) and GSM_VOICE_ROUTING_COMFORT_NOISE=level
+adds white noise of given mean absolute sample (e.g. 8) to quieter periods,
+e.g. uplink ducked by walkie or suppressed by speex preprocessor. Downlink
+is levelled before it's played, so the echo reference matches.
+
+Instead of retrying to open the cards every 100 ms, we wait for a change in
+/dev/snd (inotify), e.g. modem card appearing. If the device node is there
+and just can't be opened yet (busy), it's retried every period. During the call, removal of modem device node or its disconnected
+state is hangup, without waiting for the read to fail. Routing starts with
+the first period read from the modem.
+
+With GSM_VOICE_ROUTING_DAEMON=1 the program does not exit at hangup, it
+closes the streams and waits for the next call. Call which can't be routed
+(e.g. cards negotiated different periods) is logged and skipped too. Buffers and echo canceller
+stay allocated, the canceller is reset for each call or with
+GSM_VOICE_ROUTING_AEC_KEEP=1 it starts with the filter converged in the
+previous call, so there is no echo burst while it converges again.
+
+All period buffers, rings and fifos are taken from one arena allocated and
+locked in memory at startup (see arena.h), so nothing allocates once the
+routing starts. Only speex allocates its echo canceller, preprocessor and
+resampler states itself, once with the first call.
+
+Aux leds are written by a normal priority helper thread from files opened
+once, routing threads only leave the wanted state in a mailbox.
+
+Log messages get CLOCK_MONOTONIC timestamp and are queued in a lock-free
+ring, from which a normal priority thread writes them to the logfile, so
+routing threads never wait for slow storage.
+
+After playback underrun the stream is prepared and restarted right away with
+GSM_VOICE_ROUTING_XRUN_FILL periods (2 by default): silence and then the
+period that did not fit. Without it playback would wait until the whole
+buffer is filled again (start threshold), which is over 100ms of silence
+and the capture side overrunning meanwhile. 0 keeps the old behaviour.
+
+With GSM_VOICE_ROUTING_LINK=1 (single thread and poll mode) capture and
+playback of each card are linked with snd_pcm_link() and started together
+after the playback is primed with GSM_VOICE_ROUTING_XRUN_FILL periods of
+silence (at least one). Their phase, and so the latency, is then the same in
+every call instead of depending on when each stream happened to start.
+Linked streams stop and restart together on xrun. Until the routing starts,
+p0 is fed silence in pace of r0. Delays of both streams right after the
+start are logged.
+
+GSM_VOICE_ROUTING_RECORD_DIR=directory records every call into
+call-YYYYMMDD-HHMMSS.wav there, stereo S16_LE 8000Hz with uplink (what is
+sent to umts, after echo cancellation) on the left and downlink (what is
+played on speaker) on the right channel. Playback streams copy each written
+period into lock-free rings and a normal priority thread drains them to disk
+every RECORD_FLUSH_MS, so routing threads never do file I/O. Without the
+variable the copy is one not taken branch per period.
+
+GSM_VOICE_ROUTING_CONTROL=path creates UNIX domain stream socket there,
+serviced by a normal priority thread. It takes one command per line and
+answers with lines ending with "ok" or "error ...":
+
+mute uplink|downlink 0|1     - silence the direction
+gain uplink|downlink percent - volume of the direction, 100 is unchanged
+aec backend                  - switch echo suppression backend
+endpoint name                - move r0 and p0 to another local endpoint
+stats                        - counters and timing of both directions
+reopen                       - close and open all streams again
+
+Routing threads pick the settings up at period boundary, they are plain
+atomic variables, so the threads never wait for the control thread. E.g.
+echo "mute uplink 1" | socat - UNIX-CONNECT:/tmp/gsm-voice-routing.
+The control thread runs even without the socket: it builds echo canceller
+state of a new backend (voice_processing_maintain()) and the thread doing
+uplink processing only swaps it in, so nothing is allocated there mid-call.
+
+Echo reference is taken from history of everything written to p0. It is
+aligned with the microphone using snd_pcm_delay() of p0 and r0, so it's the
+sound that was coming out of the speaker while the period was recorded and
+the filter only has to cover acoustic path, not the sound card buffers.
+
+GSM_VOICE_ROUTING_MODE=latency does not route, it measures latency of one
+card instead: it plays a LATENCY_CHIRP_FRAMES long 300-3400Hz chirp on p0
+(or p1 with GSM_VOICE_ROUTING_LATENCY_CARD=1) and finds it by normalized
+cross-correlation in what r0 (r1) recorded during the next second. The
+path is closed acoustically from speaker to microphone, by a loopback cable
+or, for the modem, by echo of the other end. Each of
+GSM_VOICE_ROUTING_LATENCY_TRIALS (10) trials logs round trip from handing
+the chirp to ALSA until it's read back, split into the playback part
+(snd_pcm_delay() when written), the path itself and the capture part
+(snd_pcm_delay() plus the period when read). Average, min, max and jitter
+(standard deviation) of the trials are logged at the end, for the geometry
+and card configuration given by the other variables. Exit code is 0 if the
+chirp was found in all trials.
+
+For every stream we count periods, xruns, short reads/writes and other
+errors and sample snd_pcm_delay() after each period. For each direction we
+measure time spent processing the period (min/avg/p99/max). Together with
+frames queued in jitter buffer and drift compensation this gives estimate of
+end-to-end latency. Summary line per direction is logged at hangup and every
+GSM_VOICE_ROUTING_STATS_INTERVAL seconds if set.
+
+Built with -DUSE_PROFILER, each stage of the routing loop (poll, read of r0
+and r1 including waiting for the card, echo reference, echo suppression,
+downlink copy, writes) is timed with CLOCK_MONOTONIC_RAW into power of two
+histograms in static memory. Count and avg/p50/p99/max us per stage are
+logged at hangup and on SIGUSR1 during the call (the handler only sets a
+flag, control thread logs the report). Without the define the stage markers
+compile to the bare statements.
+
 */
 
 /* Use the newer ALSA API */
 #define ALSA_PCM_NEW_HW_PARAMS_API
 
-/* Define this to enable speex acoustic echo cancellation */
-#define USE_SPEEX_AEC
-
-/* Define this to use walkie talkie echo reduction */
-//#define USE_WALKIE_TALKIE_AEC
+/* For pthread_setaffinity_np() */
+#define _GNU_SOURCE
 
 #include <time.h>
+#include <math.h>
+#include <ctype.h>
 #include <fcntl.h>
+#include <stdarg.h>
+#include <sched.h>
 #include <signal.h>
 #include <unistd.h>
 #include <string.h>
+#include <pthread.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/inotify.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 #include <alsa/asoundlib.h>
 
-#ifdef USE_SPEEX_AEC
-#include <speex/speex_echo.h>
-#endif
+#include <speex/speex_resampler.h>
+
+#include "voice-processing.h"
+#include "dsp-kernels.h"
+#include "arena.h"
 
 #define ERR_PCM_OPEN_FAILED -1
 #define ERR_HW_PARAMS_ANY -2
@@ -93,12 +304,317 @@ period - this is our latency.
 #define ERR_WRITE -19
 #define ERR_SHORT_WRITE -20
 #define ERR_TERMINATING -21
+#define ERR_AGAIN -22
+
+#define MODE_SINGLE_THREAD 0
+#define MODE_THREADS 1
+#define MODE_POLL 2
+#define MODE_LATENCY 3
+
+#define MAX_POLL_FDS 16
 
-#define s16 short
-#define u16 unsigned short
+/* Stack we touch in advance so that realtime thread does not page fault */
+#define RT_STACK_PREFAULT (64 * 1024)
+
+/* Stack size of routing threads, so that mlockall() does not lock default
+   8MB for each one */
+#define RT_THREAD_STACK (256 * 1024)
+
+/* How often main passes SIGINT/SIGTERM on to a routing thread it joins */
+#define THREAD_JOIN_MS 50
+
+/* Stack size of normal priority helper threads (log, leds, recording,
+   control), they are locked by mlockall() too */
+#define HELPER_THREAD_STACK (64 * 1024)
+
+/* Processing time histogram - bucket width and count */
+#define PROC_HIST_US 50
+#define PROC_HIST_BUCKETS 200
+
+/* Max clock drift we compensate, in ppm */
+#define DRIFT_MAX_PPM 5000
+
+/* Single thread mode - periods one capture can get ahead of the other before
+   one of its periods is dropped */
+#define DRIFT_CAPTURE_AHEAD 2
+
+/* How many periods in row the jitter buffer can stay above target before we
+   drop one period */
+#define JITTER_ABOVE_TARGET_MAX 50
+
+/* Concealed periods are attenuated by half each, this many make silence */
+#define JITTER_CONCEAL_MAX 4
+
+/* Log ring - number of records (power of two), max message length and how
+   often the writer thread wakes up */
+#define LOG_RECORDS 256
+#define LOG_RECORD_SIZE 160
+#define LOG_FLUSH_MS 100
+
+/* How often led helper thread shows the wanted state */
+#define LED_POLL_MS 50
+
+/* How long to wait for sound card change before trying to open it anyway */
+#define CALL_WAIT_MS 1000
+
+/* Call recording - frames in each direction's ring (power of two, 2s), how
+   often the writer thread drains them and how long end of call waits for
+   the file to be finished */
+#define RECORD_RING_FRAMES 16384
+#define RECORD_FLUSH_MS 500
+#define RECORD_CLOSE_MS 2000
+
+/* How often control thread checks if it should stop and longest command */
+#define CONTROL_POLL_MS 500
+#define CONTROL_LINE 128
+
+/* Local endpoints (handset, headset, bluetooth...) and longest name and
+   pcm device of one */
+#define MAX_ENDPOINTS 8
+#define ENDPOINT_NAME 16
+#define ENDPOINT_PCM 48
+
+/* Latency test - chirp length, band, level, capture window after the chirp
+   is written, silence between trials and minimal correlation peak in
+   percent */
+#define LATENCY_CHIRP_FRAMES 2048
+#define LATENCY_CHIRP_FROM 300
+#define LATENCY_CHIRP_TO 3400
+#define LATENCY_CHIRP_LEVEL 8000
+#define LATENCY_WINDOW_FRAMES 8000
+#define LATENCY_GAP_MS 300
+#define LATENCY_MIN_PEAK 30
+
+/* Direction index of control settings */
+#define DIR_UPLINK 0
+#define DIR_DOWNLINK 1
 
 FILE *logfile;
-int terminating = 0;
+
+/* Set by signal handler to the signal number, everything stops then and
+   main() tears down */
+volatile sig_atomic_t terminating = 0;
+int mode = MODE_SINGLE_THREAD;
+
+/* Realtime scheduling of routing thread(s), priority 0 means disabled */
+int rt_priority = 0;
+int rt_policy = SCHED_FIFO;
+int rt_cpu = -1;
+
+/* Requested geometry in frames */
+snd_pcm_uframes_t period_size = 256;
+snd_pcm_uframes_t buffer_size = 1024;
+
+/* Jitter buffer (target < 0 means none) and drift compensation settings */
+int jitter_target_ms = -1;
+int jitter_max_ms = 0;
+int drift_comp = 0;
+int drift_target = 0;
+
+/* Latency test mode - trials and card (0 internal, 1 umts) */
+int latency_trials = 10;
+int latency_card = 0;
+
+/* Every buffer comes from here, see arena.h */
+struct arena arena;
+
+/* Asynchronous log.
+
+   Realtime threads must not block on logfile (it can be a file on slow
+   NAND), so log_msg() only formats the message into a fixed size record of
+   lock-free ring and low priority writer thread writes the records out every
+   LOG_FLUSH_MS. Any thread can log: producers reserve records by moving head
+   with compare and swap and each record has sequence number that tells if it
+   is free (seq == position) or filled (seq == position + 1), so the writer
+   never sees half written record. When the ring is full, the message is
+   dropped and counted.
+
+   Before log_start() and after log_stop() messages are written directly. */
+struct log_record
+{
+    unsigned int seq;           // see above
+    long long us;               // CLOCK_MONOTONIC time of the message
+    char text[LOG_RECORD_SIZE];
+};
+
+struct log_ring
+{
+    struct log_record records[LOG_RECORDS];
+    unsigned int head;          // next record to reserve, all producers
+    unsigned int tail;          // next record to write, writer only
+    unsigned int dropped;       // messages lost because ring was full
+    int running;                // writer thread is running
+    int stop;                   // writer should finish
+    pthread_t writer;
+};
+
+struct log_ring log_ring;
+
+static long long log_time_us()
+{
+    struct timespec tp;
+    clock_gettime(CLOCK_MONOTONIC, &tp);
+    return tp.tv_sec * 1000000LL + tp.tv_nsec / 1000;
+}
+
+static void log_write(long long us, const char *text)
+{
+    size_t len = strlen(text);
+
+    fprintf(logfile, "%lld.%03lld %s%s", us / 1000000, (us / 1000) % 1000,
+            text, len > 0 && text[len - 1] == '\n' ? "" : "\n");
+}
+
+static void log_msg(const char *fmt, ...)
+    __attribute__ ((format(printf, 1, 2)));
+
+static void log_msg(const char *fmt, ...)
+{
+    struct log_record *r;
+    unsigned int pos;
+    unsigned int seq;
+    char text[LOG_RECORD_SIZE];
+    va_list ap;
+
+    if (!__atomic_load_n(&log_ring.running, __ATOMIC_ACQUIRE)) {
+        va_start(ap, fmt);
+        vsnprintf(text, sizeof(text), fmt, ap);
+        va_end(ap);
+        log_write(log_time_us(), text);
+        return;
+    }
+
+    pos = __atomic_load_n(&log_ring.head, __ATOMIC_RELAXED);
+    for (;;) {
+        r = &log_ring.records[pos & (LOG_RECORDS - 1)];
+        seq = __atomic_load_n(&r->seq, __ATOMIC_ACQUIRE);
+        if (seq == pos) {
+            if (__atomic_compare_exchange_n(&log_ring.head, &pos, pos + 1, 0,
+                                            __ATOMIC_RELAXED,
+                                            __ATOMIC_RELAXED)) {
+                break;
+            }
+        } else if ((int)(seq - pos) < 0) {
+            __atomic_fetch_add(&log_ring.dropped, 1, __ATOMIC_RELAXED);
+            return;
+        } else {
+            pos = __atomic_load_n(&log_ring.head, __ATOMIC_RELAXED);
+        }
+    }
+
+    r->us = log_time_us();
+    va_start(ap, fmt);
+    vsnprintf(r->text, sizeof(r->text), fmt, ap);
+    va_end(ap);
+    __atomic_store_n(&r->seq, pos + 1, __ATOMIC_RELEASE);
+}
+
+/* Write out all filled records, returns 1 if there were any */
+static int log_drain()
+{
+    struct log_record *r;
+    unsigned int dropped;
+    int any = 0;
+
+    for (;;) {
+        r = &log_ring.records[log_ring.tail & (LOG_RECORDS - 1)];
+        if (__atomic_load_n(&r->seq, __ATOMIC_ACQUIRE) != log_ring.tail + 1) {
+            break;
+        }
+        log_write(r->us, r->text);
+        __atomic_store_n(&r->seq, log_ring.tail + LOG_RECORDS,
+                         __ATOMIC_RELEASE);
+        log_ring.tail++;
+        any = 1;
+    }
+
+    dropped = __atomic_exchange_n(&log_ring.dropped, 0, __ATOMIC_RELAXED);
+    if (dropped) {
+        fprintf(logfile, "log ring full, %u messages dropped\n", dropped);
+        any = 1;
+    }
+    return any;
+}
+
+static void *log_writer(void *arg)
+{
+    struct timespec ts = { 0, LOG_FLUSH_MS * 1000000L };
+
+    while (!__atomic_load_n(&log_ring.stop, __ATOMIC_ACQUIRE)) {
+        if (log_drain()) {
+            fflush(logfile);
+        }
+        nanosleep(&ts, 0);
+    }
+    log_drain();
+    fflush(logfile);
+    return 0;
+}
+
+/* Create normal priority helper thread with small stack. It does not take
+   SIGINT/SIGTERM, so they interrupt what routing waits for. */
+static int helper_thread_create(pthread_t *thread, void *(*fn)(void *))
+{
+    pthread_attr_t attr;
+    sigset_t block;
+    sigset_t old;
+    int rc;
+
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, HELPER_THREAD_STACK);
+    sigemptyset(&block);
+    sigaddset(&block, SIGINT);
+    sigaddset(&block, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &block, &old);
+    rc = pthread_create(thread, &attr, fn, 0);
+    pthread_sigmask(SIG_SETMASK, &old, 0);
+    pthread_attr_destroy(&attr);
+    return rc;
+}
+
+/* Start writer thread. It must be called before the process gets realtime
+   priority, so that the writer inherits normal one. */
+static void log_start()
+{
+    unsigned int i;
+
+    for (i = 0; i < LOG_RECORDS; i++) {
+        log_ring.records[i].seq = i;
+    }
+    log_ring.head = 0;
+    log_ring.tail = 0;
+    log_ring.dropped = 0;
+    log_ring.stop = 0;
+    if (helper_thread_create(&log_ring.writer, log_writer)) {
+        fprintf(logfile, "failed to create log writer thread\n");
+        return;
+    }
+    __atomic_store_n(&log_ring.running, 1, __ATOMIC_RELEASE);
+}
+
+/* Write out what's left and continue logging directly */
+static void log_stop()
+{
+    if (!__atomic_load_n(&log_ring.running, __ATOMIC_ACQUIRE)) {
+        return;
+    }
+    __atomic_store_n(&log_ring.running, 0, __ATOMIC_RELEASE);
+    __atomic_store_n(&log_ring.stop, 1, __ATOMIC_RELEASE);
+    pthread_join(log_ring.writer, 0);
+}
+
+/* Counters for route_stream, since the stream was opened */
+struct stream_stats
+{
+    unsigned int periods;       // periods read/written
+    unsigned int xruns;         // overruns/underruns
+    unsigned int short_io;      // short reads/writes
+    unsigned int errors;        // other read/write errors
+    snd_pcm_sframes_t delay_min;    // snd_pcm_delay() after read/write
+    snd_pcm_sframes_t delay_max;
+    long long delay_sum;
+    unsigned int delay_count;
+};
 
 struct route_stream
 {
@@ -109,12 +625,39 @@ struct route_stream
     snd_pcm_uframes_t stop_threshold;   // in: stop treshold or 0 to keep default
     snd_pcm_uframes_t buffer_size;  // in/out: hw buffer size, e.g. 1024 frames
     snd_pcm_uframes_t period_size;  // in/out: period size, e.g. 256 frames
+    int nonblock;               // in: open in non-blocking mode
+    int mmap;                   // in: use mmap access instead of readi/writei
+    struct drift_comp *drift;   // in: drift compensation for playback or 0
+    struct jitter_buffer *jitter;   // in: jitter buffer in front of playback or 0
+    struct echo_history *history;   // in: record what is played here or 0
+    struct tap_ring *tap;       // in: copy what is played here for call recording or 0
+    int xrun_fill;              // in: periods to restart playback with after underrun, 0 = wait for start_threshold
+    struct route_stream *link;  // out: other stream on the same card linked with this one or 0
+    unsigned int rate;          // in: card sample rate, multiple of 8000
+    snd_pcm_format_t format;    // in: card sample format
+    unsigned int channels;      // in: card channels
 
     snd_pcm_t *handle;          // out: pcm handle
     snd_pcm_hw_params_t *hwparams;  // out:
     snd_pcm_sw_params_t *swparams;  // out:
     int period_buffer_size;     // out: size 2000 (256 frames=256 samples, one sample=2bytes)
-    char *period_buffer;        // out: allocated buffer for playing/recording
+    char *period_buffer;        // out: buffer for playing/recording, in mmap mode it can point to sound card's buffer
+    char *own_buffer;           // out: allocated buffer for playing/recording
+    int pending;                // period_buffer waits to be played (poll mode)
+    int due;                    // jitter pulls owed, one per period (poll mode)
+    int mmap_held;              // period_buffer is mmap area not yet committed
+    snd_pcm_uframes_t mmap_offset;  // offset of the held mmap area
+    snd_pcm_sframes_t delay;    // out: last snd_pcm_delay() after read/write
+    int rate_factor;            // out: card frames per 8000Hz frame
+    snd_pcm_uframes_t hw_period_size;   // out: period in card frames
+    char *hw_buffer;            // out: period in card format, 0 = no conversion
+    int hw_buffer_size;         // out: bytes in hw_buffer
+    int hw_ready;               // hw_buffer is converted but not played yet
+    s16 *rate_buffer;           // out: period at card rate, S16 mono
+    SpeexResamplerState *resampler;     // out: rate conversion or 0
+    char *silence;              // out: silent card period for xrun recovery
+    int silence_size;           // out: bytes in silence
+    struct stream_stats stats;  // out: counters
 };
 
 /* Dump error on stderr with stream and error description, and return given
@@ -126,20 +669,103 @@ static int err(const char *msg, int snd_err, struct route_stream *s,
         return ERR_TERMINATING;
     }
     
-    fprintf(logfile, "%s (%s): %s", s->id, s->pcm_name, msg);
-    if (snd_err < 0) {
-        fprintf(logfile, ": %s", snd_strerror(snd_err));
-    }
-    fprintf(logfile, "\n");
+    log_msg("%s (%s): %s%s%s\n", s->id, s->pcm_name, msg,
+            snd_err < 0 ? ": " : "", snd_err < 0 ? snd_strerror(snd_err) : "");
     return return_code;
 }
 
+/* Card does not take our S16_LE mono 8000Hz as is */
+static int route_stream_converts(struct route_stream *s)
+{
+    return s->rate != 8000 || s->format != SND_PCM_FORMAT_S16_LE ||
+        s->channels != 1;
+}
+
+/* Bytes open_route_stream() takes from arena for conversion buffers and
+   silence */
+static size_t route_stream_memory(struct route_stream *s,
+                                  snd_pcm_uframes_t period)
+{
+    size_t frames = period * (s->rate / 8000);
+    size_t card_period = frames * s->channels *
+        snd_pcm_format_physical_width(s->format) / 8;
+    size_t size = 0;
+
+    if (s->stream == SND_PCM_STREAM_PLAYBACK) {
+        size += ARENA_BLOCK(card_period);
+    }
+    if (route_stream_converts(s)) {
+        size += ARENA_BLOCK(card_period) + ARENA_BLOCK(frames * sizeof(s16));
+    }
+    return size;
+}
+
+/* Conversion buffers are kept after close like the period buffer, the
+   resampler too, as the rate does not change */
+static int alloc_conversion(struct route_stream *s)
+{
+    int size = s->hw_period_size * s->channels *
+        snd_pcm_format_physical_width(s->format) / 8;
+    int rc;
+
+    s->hw_ready = 0;
+    if (s->hw_buffer == 0 || s->hw_buffer_size != size) {
+        s->hw_buffer_size = size;
+        s->hw_buffer = (char *)arena_alloc(&arena, size);
+        s->rate_buffer = (s16 *) arena_alloc(&arena, s->hw_period_size *
+                                             sizeof(s16));
+        if (s->hw_buffer == 0 || s->rate_buffer == 0) {
+            s->hw_buffer = 0;
+            return err("conversion buffer alloc failed", 0, s,
+                       ERR_BUFFER_ALLOC_FAILED);
+        }
+    }
+    if (s->rate_factor == 1) {
+        return 0;
+    }
+    if (s->resampler) {
+        speex_resampler_reset_mem(s->resampler);
+        return 0;
+    }
+    if (s->stream == SND_PCM_STREAM_CAPTURE) {
+        s->resampler = speex_resampler_init(1, s->rate, 8000,
+                                            SPEEX_RESAMPLER_QUALITY_VOIP, &rc);
+    } else {
+        s->resampler = speex_resampler_init(1, 8000, s->rate,
+                                            SPEEX_RESAMPLER_QUALITY_VOIP, &rc);
+    }
+    if (s->resampler == 0) {
+        return err("resampler init failed", 0, s, ERR_BUFFER_ALLOC_FAILED);
+    }
+    return 0;
+}
+
+/* Resampler state is the only thing not in arena */
+static void route_stream_destroy(struct route_stream *s)
+{
+    if (s->resampler) {
+        speex_resampler_destroy(s->resampler);
+        s->resampler = 0;
+    }
+}
+
 static int open_route_stream(struct route_stream *s)
 {
+    snd_pcm_uframes_t hw_buffer_size;
     int rc;
+    int dir;
+
+    /* Card frames are converted from/to period_buffer, no direct mmap */
+    s->rate_factor = s->rate / 8000;
+    if (s->mmap && route_stream_converts(s)) {
+        log_msg("%s (%s): converted stream, not using mmap\n", s->id,
+                s->pcm_name);
+        s->mmap = 0;
+    }
 
     /* Open PCM device for playback. */
-    rc = snd_pcm_open(&(s->handle), s->pcm_name, s->stream, 0);
+    rc = snd_pcm_open(&(s->handle), s->pcm_name, s->stream,
+                      s->nonblock ? SND_PCM_NONBLOCK : 0);
     if (rc < 0) {
         return err("unable to open pcm device", rc, s, ERR_PCM_OPEN_FAILED);
     }
@@ -155,45 +781,59 @@ static int open_route_stream(struct route_stream *s)
 
     /* Interleaved mode */
     rc = snd_pcm_hw_params_set_access(s->handle, s->hwparams,
-                                      SND_PCM_ACCESS_RW_INTERLEAVED);
+                                      s->mmap ? SND_PCM_ACCESS_MMAP_INTERLEAVED
+                                      : SND_PCM_ACCESS_RW_INTERLEAVED);
     if (rc < 0) {
         return err("snd_pcm_hw_params_set_access failed", rc, s,
                    ERR_HW_PARAMS_SET_ACCESS);
     }
 
-    /* Signed 16-bit little-endian format */
-    rc = snd_pcm_hw_params_set_format(s->handle, s->hwparams,
-                                      SND_PCM_FORMAT_S16_LE);
+    /* Signed 16-bit little-endian format unless configured otherwise */
+    rc = snd_pcm_hw_params_set_format(s->handle, s->hwparams, s->format);
     if (rc < 0) {
         return err("snd_pcm_hw_params_set_format failed", rc, s,
                    ERR_HW_PARAMS_SET_FORMAT);
     }
 
-    /* One channel (mono) */
-    rc = snd_pcm_hw_params_set_channels(s->handle, s->hwparams, 1);
+    /* One channel (mono) unless configured otherwise */
+    rc = snd_pcm_hw_params_set_channels(s->handle, s->hwparams, s->channels);
     if (rc < 0) {
         return err("snd_pcm_hw_params_set_channels failed", rc, s,
                    ERR_HW_PARAMS_SET_CHANNELS);
     }
 
-    /* 8000 bits/second sampling rate (umts modem quality) */
-    rc = snd_pcm_hw_params_set_rate(s->handle, s->hwparams, 8000, 0);
+    /* 8000 samples/second sampling rate (umts modem quality) unless
+       configured otherwise */
+    rc = snd_pcm_hw_params_set_rate(s->handle, s->hwparams, s->rate, 0);
     if (rc < 0) {
         return err("snd_pcm_hw_params_set_rate_near failed", rc, s,
                    ERR_HW_PARAMS_SET_RATE);
     }
 
-    /* Period size in frames (e.g. 256) */
+    /* Period size in frames (e.g. 256), nearest supported if the card can't
+       do exact value. Card frames at its own rate. */
+    s->hw_period_size = s->period_size * s->rate_factor;
     rc = snd_pcm_hw_params_set_period_size(s->handle, s->hwparams,
-                                           s->period_size, 0);
+                                           s->hw_period_size, 0);
+    if (rc < 0) {
+        dir = 0;
+        rc = snd_pcm_hw_params_set_period_size_near(s->handle, s->hwparams,
+                                                    &(s->hw_period_size),
+                                                    &dir);
+    }
     if (rc < 0) {
         return err("snd_pcm_hw_params_set_period_size failed", rc, s,
                    ERR_HW_PARAMS_SET_PERIOD_SIZE);
     }
 
     /* Buffer size in frames (e.g. 1024) */
+    hw_buffer_size = s->buffer_size * s->rate_factor;
     rc = snd_pcm_hw_params_set_buffer_size(s->handle, s->hwparams,
-                                           s->buffer_size);
+                                           hw_buffer_size);
+    if (rc < 0) {
+        rc = snd_pcm_hw_params_set_buffer_size_near(s->handle, s->hwparams,
+                                                    &hw_buffer_size);
+    }
     if (rc < 0) {
         return err("snd_pcm_hw_params_set_buffer_size failed", rc, s,
                    ERR_HW_PARAMS_SET_BUFFER_SIZE);
@@ -205,12 +845,67 @@ static int open_route_stream(struct route_stream *s)
         return err("snd_pcm_hw_params failed", rc, s, ERR_HW_PARAMS);
     }
 
+    /* Report what we really got */
+    snd_pcm_hw_params_get_period_size(s->hwparams, &(s->hw_period_size), &dir);
+    snd_pcm_hw_params_get_buffer_size(s->hwparams, &hw_buffer_size);
+    if (s->hw_period_size % s->rate_factor) {
+        return err("period is not whole number of 8000Hz frames", 0, s,
+                   ERR_HW_PARAMS_SET_PERIOD_SIZE);
+    }
+    s->period_size = s->hw_period_size / s->rate_factor;
+    s->buffer_size = hw_buffer_size / s->rate_factor;
+    log_msg("%s (%s): period %lu frames, buffer %lu frames\n",
+            s->id, s->pcm_name, (unsigned long)s->period_size,
+            (unsigned long)s->buffer_size);
+    if (route_stream_converts(s)) {
+        log_msg("%s (%s): card runs %u Hz %s %u channels, converting\n",
+                s->id, s->pcm_name, s->rate, snd_pcm_format_name(s->format),
+                s->channels);
+    }
+
+    /* Thresholds can't be bigger than what we got */
+    if (s->start_threshold > s->buffer_size) {
+        s->start_threshold = s->buffer_size;
+    }
+    if (s->stop_threshold > s->buffer_size) {
+        s->stop_threshold = s->buffer_size;
+    }
+
     /* Allocate buffer for one period twice as big as period_size because:
-       1 frame = 1 sample = 2 bytes because of S16_LE and 1 channel */
-    s->period_buffer_size = 2 * s->period_size;
-    s->period_buffer = (char *)malloc(s->period_buffer_size);
-    if (s->period_buffer == 0) {
-        return err("period_buffer alloc failed", 0, s, ERR_BUFFER_ALLOC_FAILED);
+       1 frame = 1 sample = 2 bytes because of S16_LE and 1 channel. It's
+       kept after close, so in daemon mode it's allocated only once. */
+    if (s->own_buffer == 0 || s->period_buffer_size != 2 * s->period_size) {
+        s->period_buffer_size = 2 * s->period_size;
+        s->own_buffer = (char *)arena_alloc(&arena, s->period_buffer_size);
+        if (s->own_buffer == 0) {
+            return err("period_buffer alloc failed", 0, s,
+                       ERR_BUFFER_ALLOC_FAILED);
+        }
+    }
+    s->period_buffer = s->own_buffer;
+    s->mmap_held = 0;
+    memset(&(s->stats), 0, sizeof(s->stats));
+
+    if (route_stream_converts(s)) {
+        rc = alloc_conversion(s);
+        if (rc < 0) {
+            return rc;
+        }
+    }
+
+    /* All supported formats are signed, so silence is zeros */
+    if (s->stream == SND_PCM_STREAM_PLAYBACK) {
+        rc = s->hw_period_size * s->channels *
+            snd_pcm_format_physical_width(s->format) / 8;
+        if (s->silence == 0 || s->silence_size != rc) {
+            s->silence_size = rc;
+            s->silence = (char *)arena_alloc(&arena, rc);
+            if (s->silence == 0) {
+                return err("silence alloc failed", 0, s,
+                           ERR_BUFFER_ALLOC_FAILED);
+            }
+            memset(s->silence, 0, rc);
+        }
     }
 
     /* Setup software params */
@@ -227,7 +922,8 @@ static int open_route_stream(struct route_stream *s)
         if (s->start_threshold > 0) {
             rc = snd_pcm_sw_params_set_start_threshold(s->handle,
                                                        s->swparams,
-                                                       s->start_threshold);
+                                                       s->start_threshold *
+                                                       s->rate_factor);
             if (rc < 0) {
                 return err("snd_pcm_sw_params_set_start_threshold failed", rc,
                            s, ERR_SW_PARAMS_SET_START_THRESHOLD);
@@ -238,7 +934,8 @@ static int open_route_stream(struct route_stream *s)
         if (s->stop_threshold > 0) {
             rc = snd_pcm_sw_params_set_stop_threshold(s->handle,
                                                       s->swparams,
-                                                      s->stop_threshold);
+                                                      s->stop_threshold *
+                                                      s->rate_factor);
             if (rc < 0) {
                 return err("snd_pcm_sw_params_set_start_threshold failed", rc,
                            s, ERR_SW_PARAMS_SET_STOP_THRESHOLD);
@@ -265,140 +962,1558 @@ static int close_route_stream(struct route_stream *s)
     if (s->handle == 0) {
         return 0;
     }
+    if (s->link) {
+        snd_pcm_unlink(s->handle);
+        s->link->link = 0;
+        s->link = 0;
+    }
     snd_pcm_close(s->handle);
     s->handle = 0;
-    if (s->period_buffer == 0) {
-        return 0;
-    }
-    free(s->period_buffer);
     s->period_buffer = 0;
+    s->hw_ready = 0;
     return 0;
 }
 
-static void open_route_stream_repeated(struct route_stream *s)
+/* Call state detection.
+
+   Device nodes in /dev/snd are watched with inotify. While we wait for a call,
+   failed open of missing device is retried when a node is created or its
+   permissions change (modem card appeared) instead of every 100 ms. Closes
+   are not watched, our own open attempt would wake us. During the call,
+   removal of modem's device node or disconnected r1 means hangup right away,
+   without waiting until read fails. */
+struct call_watch
 {
-    int rc;
-    for (;;) {
-        rc = open_route_stream(s);
-        if (rc == 0) {
-            return;
-        }
-        close_route_stream(s);
-        fprintf(logfile, "retrying in 100 ms\n");
-        usleep(1000 * 100);
-    }
-}
+    int fd;                     // inotify descriptor or -1
+    char node_prefix[16];       // modem device nodes, e.g. "pcmC1D"
+    int hangup;                 // modem device node was removed
+};
 
-static int route_stream_read(struct route_stream *s)
+struct call_watch call_watch = { .fd = -1 };
+
+static void call_watch_init(struct call_watch *cw, const char *pcm_name)
 {
-    int rc;
+    int card;
 
-    if (terminating) {
-        return ERR_TERMINATING;
+    cw->hangup = 0;
+    cw->node_prefix[0] = 0;
+    if (sscanf(pcm_name, "hw:%d", &card) == 1) {
+        snprintf(cw->node_prefix, sizeof(cw->node_prefix), "pcmC%dD", card);
     }
 
-    rc = snd_pcm_readi(s->handle, s->period_buffer, s->period_size);
-    if (rc == s->period_size) {
-        return 0;
+    cw->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (cw->fd < 0) {
+        log_msg("inotify_init1 failed: %s\n", strerror(errno));
+        return;
     }
-
-    /* EPIPE means overrun */
-    if (rc == -EPIPE) {
-        err("overrun occured", rc, s, ERR_READ_OVERRUN);
-        snd_pcm_prepare(s->handle);
-        return ERR_READ_OVERRUN;
+    if (inotify_add_watch(cw->fd, "/dev/snd", IN_CREATE | IN_DELETE |
+                          IN_ATTRIB) < 0) {
+        log_msg("inotify_add_watch /dev/snd failed: %s\n",
+                strerror(errno));
+        close(cw->fd);
+        cw->fd = -1;
     }
+}
 
-    if (rc < 0) {
-        return err("snd_pcm_readi failed", rc, s, ERR_READ);
+static void call_watch_close(struct call_watch *cw)
+{
+    if (cw->fd >= 0) {
+        close(cw->fd);
+        cw->fd = -1;
     }
-
-    return err("short read", rc, s, ERR_SHORT_READ);
 }
 
-static int route_stream_write(struct route_stream *s)
+/* Read pending inotify events, returns how many there were */
+static int call_watch_events(struct call_watch *cw)
 {
-    int rc;
-
-    if (terminating) {
-        return ERR_TERMINATING;
-    }
+    char buf[1024] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+    const struct inotify_event *ev;
+    int count = 0;
+    ssize_t len;
+    char *pos;
 
-    rc = snd_pcm_writei(s->handle, s->period_buffer, s->period_size);
-    if (rc == s->period_size) {
+    if (cw->fd < 0) {
         return 0;
     }
-
-    /* EPIPE means underrun */
-    if (rc == -EPIPE) {
-        err("underrun occured", rc, s, ERR_WRITE_UNDERRUN);
-        snd_pcm_prepare(s->handle);
-        return ERR_WRITE_UNDERRUN;
-    }
-
-    if (rc < 0) {
-        return err("snd_pcm_writei failed", rc, s, ERR_WRITE);
+    while ((len = read(cw->fd, buf, sizeof(buf))) > 0) {
+        for (pos = buf; pos < buf + len; pos += sizeof(*ev) + ev->len) {
+            ev = (const struct inotify_event *)pos;
+            count++;
+            if ((ev->mask & IN_DELETE) && ev->len > 0 && cw->node_prefix[0] &&
+                strncmp(ev->name, cw->node_prefix,
+                        strlen(cw->node_prefix)) == 0) {
+                cw->hangup = 1;
+            }
+        }
     }
-
-    return err("short write", rc, s, ERR_SHORT_WRITE);
+    return count;
 }
 
-/*static void log_with_timestamp(const char *msg)
+/* Sleep until something changes in /dev/snd or timeout_ms elapses */
+static void call_watch_wait(struct call_watch *cw, int timeout_ms)
 {
-    struct timespec tp;
-    clock_gettime(CLOCK_MONOTONIC, &tp);
-    fprintf(logfile, "%ld %ld: %s\n", tp.tv_sec, tp.tv_nsec, msg);
-}*/
+    struct pollfd pfd;
 
-// Write string count bytes long to file
-static void write_file(const char *path, const char *value, size_t count)
-{
-    int fd = open(path, O_WRONLY);
-    if (fd < 0) {
+    if (cw->fd < 0) {
+        usleep(1000 * (timeout_ms < 100 ? timeout_ms : 100));
         return;
     }
-    write(fd, value, count);
-    close(fd);
+    pfd.fd = cw->fd;
+    pfd.events = POLLIN;
+    if (poll(&pfd, 1, timeout_ms) > 0) {
+        call_watch_events(cw);
+    }
 }
 
-int aux_red_state = 0;
-int aux_green_state = 0;
-
-static void set_aux_leds(int red, int green)
+/* Returns 1 if the call is over. Cheap enough to be called every period. */
+static int call_watch_hangup(struct call_watch *cw, struct route_stream *s)
 {
-    if (aux_red_state == red && aux_green_state == green) {
-        return;
-    }
-    aux_red_state = red;
-    aux_green_state = green;
-
-    if (red) {
-        write_file("/sys/class/leds/gta04:red:aux/brightness", "255", 3);
-    } else {
-        write_file("/sys/class/leds/gta04:red:aux/brightness", "0", 1);
+    call_watch_events(cw);
+    if (cw->hangup) {
+        log_msg("modem sound card removed (hangup)\n");
+        return 1;
     }
-    if (green) {
-        write_file("/sys/class/leds/gta04:green:aux/brightness", "255", 3);
-    } else {
-        write_file("/sys/class/leds/gta04:green:aux/brightness", "0", 1);
+    if (snd_pcm_state(s->handle) == SND_PCM_STATE_DISCONNECTED) {
+        log_msg("modem sound card disconnected (hangup)\n");
+        return 1;
     }
+    return 0;
 }
 
-static void blink_aux()
+/* Returns 0 if the stream's device node is not in /dev/snd, 1 if it is or
+   the pcm is not a hw one */
+static int route_stream_node_present(struct route_stream *s)
 {
-    static int last_blink_secs;
-
-    struct timespec tp;
-    clock_gettime(CLOCK_MONOTONIC, &tp);
+    struct stat st;
+    char node[32];
+    int card, device;
 
-    if (tp.tv_sec == last_blink_secs) {
-        return;
+    if (sscanf(s->pcm_name, "hw:%d,%d", &card, &device) != 2) {
+        return 1;
     }
-    last_blink_secs = tp.tv_sec;
-    set_aux_leds(!aux_red_state, aux_red_state);
+    snprintf(node, sizeof(node), "/dev/snd/pcmC%dD%d%c", card, device,
+             s->stream == SND_PCM_STREAM_PLAYBACK ? 'p' : 'c');
+    return stat(node, &st) == 0;
 }
 
-static void show_progress()
+/* Open, retry every period while the device is there (busy) or when
+   /dev/snd changes while it's missing */
+static void open_route_stream_repeated(struct route_stream *s)
+{
+    int period_ms = s->period_size * 1000 / 8000;
+    int logged = 0;
+    int rc;
+
+    if (period_ms <= 0) {
+        period_ms = 1;
+    }
+    for (;;) {
+        rc = open_route_stream(s);
+        if (rc == 0) {
+            return;
+        }
+        close_route_stream(s);
+        if (terminating) {
+            return;
+        }
+        if (!logged) {
+            log_msg("waiting for sound card change\n");
+            logged = 1;
+        }
+
+        /* Forget what our own attempt did in /dev/snd */
+        call_watch_events(&call_watch);
+        call_watch_wait(&call_watch, route_stream_node_present(s) ?
+                        period_ms : CALL_WAIT_MS);
+    }
+}
+
+/* Address of frame at given offset in mmap area (interleaved, so the first
+   channel is enough) */
+static char *mmap_area_ptr(const snd_pcm_channel_area_t *areas,
+                           snd_pcm_uframes_t offset)
+{
+    return (char *)areas[0].addr + (areas[0].first + offset * areas[0].step) / 8;
+}
+
+/* Wait until whole period can be read or written. Returns available frames
+   or negative error code. */
+static snd_pcm_sframes_t mmap_wait_avail(struct route_stream *s)
+{
+    snd_pcm_sframes_t avail;
+    int rc;
+
+    for (;;) {
+        avail = snd_pcm_avail_update(s->handle);
+        if (avail < 0 || avail >= (snd_pcm_sframes_t) s->period_size) {
+            return avail;
+        }
+        if (s->nonblock) {
+            return -EAGAIN;
+        }
+        rc = snd_pcm_wait(s->handle, 1000);
+        if (rc < 0) {
+            return rc;
+        }
+        if (terminating) {
+            return -EINTR;
+        }
+    }
+}
+
+/* Copy period between own buffer and mmap area, used when the period wraps
+   around the end of sound card buffer. Returns number of frames copied or
+   negative error code. */
+static snd_pcm_sframes_t mmap_transfer(struct route_stream *s)
+{
+    const snd_pcm_channel_area_t *areas;
+    snd_pcm_uframes_t offset;
+    snd_pcm_uframes_t frames;
+    snd_pcm_uframes_t done = 0;
+    snd_pcm_sframes_t rc;
+    int frame_bytes = s->period_buffer_size / s->period_size;
+    char *area;
+    char *buf;
+
+    while (done < s->period_size) {
+        frames = s->period_size - done;
+        rc = snd_pcm_mmap_begin(s->handle, &areas, &offset, &frames);
+        if (rc < 0) {
+            return rc;
+        }
+        area = mmap_area_ptr(areas, offset);
+        buf = s->own_buffer + done * frame_bytes;
+        if (s->stream == SND_PCM_STREAM_CAPTURE) {
+            memcpy(buf, area, frames * frame_bytes);
+        } else {
+            memcpy(area, buf, frames * frame_bytes);
+        }
+        rc = snd_pcm_mmap_commit(s->handle, offset, frames);
+        if (rc < 0) {
+            return rc;
+        }
+        done += rc;
+        if (rc != frames) {
+            break;
+        }
+    }
+    return done;
+}
+
+/* Give back mmap area of the period processed last time */
+static snd_pcm_sframes_t mmap_release(struct route_stream *s)
+{
+    snd_pcm_sframes_t rc;
+
+    if (!s->mmap_held) {
+        return 0;
+    }
+    s->mmap_held = 0;
+    rc = snd_pcm_mmap_commit(s->handle, s->mmap_offset, s->period_size);
+    return rc < 0 ? rc : 0;
+}
+
+/* mmap counterpart of snd_pcm_readi() - period_buffer is pointed directly to
+   the recorded period which stays held until next read */
+static snd_pcm_sframes_t route_stream_mmap_read(struct route_stream *s)
+{
+    const snd_pcm_channel_area_t *areas;
+    snd_pcm_uframes_t offset;
+    snd_pcm_uframes_t frames = s->period_size;
+    snd_pcm_sframes_t rc;
+
+    s->period_buffer = s->own_buffer;
+    rc = mmap_release(s);
+    if (rc < 0) {
+        return rc;
+    }
+
+    /* Capture is not started by reading as with snd_pcm_readi() */
+    if (snd_pcm_state(s->handle) == SND_PCM_STATE_PREPARED) {
+        snd_pcm_start(s->handle);
+    }
+
+    rc = mmap_wait_avail(s);
+    if (rc < 0) {
+        return rc;
+    }
+
+    rc = snd_pcm_mmap_begin(s->handle, &areas, &offset, &frames);
+    if (rc < 0) {
+        return rc;
+    }
+    if (frames < s->period_size) {
+        return mmap_transfer(s);
+    }
+
+    s->period_buffer = mmap_area_ptr(areas, offset);
+    s->mmap_offset = offset;
+    s->mmap_held = 1;
+    return s->period_size;
+}
+
+/* Point period_buffer of playback stream directly to the mmap area where the
+   next period will be played. Must be called before the period is filled.
+   If there is no space yet or the area is not contiguous, own buffer is used
+   and copied when written. */
+static void route_stream_begin(struct route_stream *s)
+{
+    const snd_pcm_channel_area_t *areas;
+    snd_pcm_uframes_t offset;
+    snd_pcm_uframes_t frames = s->period_size;
+
+    /* With drift compensation or jitter buffer the period is not played right
+       away */
+    if (!s->mmap || s->drift || s->jitter) {
+        return;
+    }
+
+    s->mmap_held = 0;
+    s->period_buffer = s->own_buffer;
+    if (mmap_wait_avail(s) < (snd_pcm_sframes_t) s->period_size) {
+        return;
+    }
+    if (snd_pcm_mmap_begin(s->handle, &areas, &offset, &frames) < 0 ||
+        frames < s->period_size) {
+        return;
+    }
+    s->period_buffer = mmap_area_ptr(areas, offset);
+    s->mmap_offset = offset;
+    s->mmap_held = 1;
+}
+
+/* mmap counterpart of snd_pcm_writei() */
+static snd_pcm_sframes_t route_stream_mmap_write(struct route_stream *s)
+{
+    snd_pcm_sframes_t rc;
+    snd_pcm_sframes_t avail;
+
+    if (s->mmap_held) {
+        s->mmap_held = 0;
+        rc = snd_pcm_mmap_commit(s->handle, s->mmap_offset, s->period_size);
+    } else {
+        rc = mmap_wait_avail(s);
+        if (rc >= 0) {
+            rc = mmap_transfer(s);
+        }
+    }
+    if (rc < 0) {
+        return rc;
+    }
+
+    /* Unlike snd_pcm_writei(), commit does not start the stream */
+    if (snd_pcm_state(s->handle) == SND_PCM_STATE_PREPARED) {
+        avail = snd_pcm_avail_update(s->handle);
+        if (avail >= 0 && s->buffer_size - avail >= s->start_threshold) {
+            snd_pcm_start(s->handle);
+        }
+    }
+    return rc;
+}
+
+static long long now_us()
+{
+    struct timespec tp;
+    clock_gettime(CLOCK_MONOTONIC, &tp);
+    return tp.tv_sec * 1000000LL + tp.tv_nsec / 1000;
+}
+
+/* Far end history - everything written to p0 is the echo reference.
+
+   Each played period is appended together with playback level (frames queued
+   in front of the speaker) sampled right after it was written. Last frame of
+   the period just read from r0 was captured r0.delay frames ago, so the
+   speaker was playing the frame level + r0.delay frames before the newest one
+   in the history. The period ending there is what the canceller gets as the
+   reference. Level is extrapolated by time elapsed since it was sampled, so
+   the reader does not need p0 and it can run in another thread.
+
+   Writer updates written/level/level_us under sequence counter (odd while
+   updating) and reader retries if it changed. History is several buffers
+   long, so the reader never copies frames that are just being overwritten. */
+struct echo_history
+{
+    s16 *buffer;
+    unsigned int size;          // frames, power of two
+    unsigned int seq;           // odd while writer updates fields below
+    unsigned int written;       // frames ever written
+    int level;                  // playback level after last write
+    long long level_us;         // when level was sampled
+    s16 *reference;             // one period for the reader
+    int reference_frames;       // frames in reference
+};
+
+struct echo_history echo_history;
+
+/* Buffers are kept if they have the right size from the previous call */
+static int echo_history_init(struct echo_history *h, unsigned int min_size,
+                             int period_frames)
+{
+    unsigned int size = 1;
+
+    while (size < min_size) {
+        size <<= 1;
+    }
+    h->seq = 0;
+    h->written = 0;
+    h->level = 0;
+    h->level_us = 0;
+    if (h->buffer && h->size == size) {
+        memset(h->buffer, 0, size * sizeof(s16));
+    } else {
+        h->size = size;
+        h->buffer = (s16 *)arena_alloc(&arena, h->size * sizeof(s16));
+    }
+    if (h->reference == 0 || h->reference_frames != period_frames) {
+        h->reference_frames = period_frames;
+        h->reference = (s16 *)arena_alloc(&arena,
+                                          period_frames * sizeof(s16));
+    }
+    return h->buffer && h->reference ? 0 : ERR_BUFFER_ALLOC_FAILED;
+}
+
+static void echo_history_write(struct echo_history *h, const char *data,
+                               int frames, int level)
+{
+    unsigned int written = h->written;
+    unsigned int seq = h->seq;
+    int i;
+
+    for (i = 0; i < frames; i++) {
+        h->buffer[(written + i) & (h->size - 1)] = ((const s16 *)data)[i];
+    }
+
+    __atomic_store_n(&h->seq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_store_n(&h->written, written + frames, __ATOMIC_RELAXED);
+    __atomic_store_n(&h->level, level, __ATOMIC_RELAXED);
+    __atomic_store_n(&h->level_us, now_us(), __ATOMIC_RELAXED);
+    __atomic_store_n(&h->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+/* Fill out with frames that were played while the last capture_delay + frames
+   frames were captured. What was not played yet or is too old is silence. */
+static void echo_history_read(struct echo_history *h, s16 *out, int frames,
+                              int capture_delay)
+{
+    unsigned int seq;
+    unsigned int written;
+    unsigned int age;
+    long long level;
+    long long level_us;
+    int i;
+
+    do {
+        seq = __atomic_load_n(&h->seq, __ATOMIC_ACQUIRE);
+        written = __atomic_load_n(&h->written, __ATOMIC_RELAXED);
+        level = __atomic_load_n(&h->level, __ATOMIC_RELAXED);
+        level_us = __atomic_load_n(&h->level_us, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    } while ((seq & 1) || seq != __atomic_load_n(&h->seq, __ATOMIC_RELAXED));
+
+    level -= (now_us() - level_us) * 8000 / 1000000;
+    if (level < 0) {
+        level = 0;
+    }
+
+    /* age of the first frame, i.e. how many frames before written it is */
+    age = level + capture_delay + frames;
+    for (i = 0; i < frames; i++, age--) {
+        if (age > written || age > h->size) {
+            out[i] = 0;
+        } else {
+            out[i] = h->buffer[(written - age) & (h->size - 1)];
+        }
+    }
+}
+
+/* Call recording.
+
+   Each recorded direction has single producer/single consumer ring: the
+   playback stream appends every period it wrote (head) and the writer
+   thread takes frames out (tail). If the writer falls behind, the period is
+   dropped and counted, producer never waits. Writer interleaves both rings
+   into stereo batch and writes it with one write() every RECORD_FLUSH_MS.
+   When one direction has nothing (e.g. stalled card) and the other has over
+   half of its ring, the missing side is written as silence, so they stay in
+   sync.
+
+   Main thread starts the file for each call by bumping call number and
+   setting recording, at the end of call it clears recording and waits until
+   the writer drained the rings and finished the file (done == call). */
+struct tap_ring
+{
+    s16 *buffer;
+    unsigned int size;          // frames, power of two
+    unsigned int head;          // frames ever written, producer only
+    unsigned int tail;          // frames ever taken, writer only
+    unsigned int dropped;       // frames lost because ring was full
+};
+
+struct recorder
+{
+    const char *dir;            // where to put the files, 0 = not recording
+    struct tap_ring uplink;     // left channel
+    struct tap_ring downlink;   // right channel
+    s16 *batch;                 // interleaved frames for one write()
+    int recording;              // call in progress, set by main thread
+    int call;                   // number of call to record
+    int done;                   // number of call whose file is finished
+    int file_call;              // call recorded in fd, writer only
+    int fd;                     // current file or -1
+    unsigned int frames;        // stereo frames in current file
+    int running;                // writer thread is running
+    int stop;                   // writer should finish
+    pthread_t thread;
+};
+
+struct recorder recorder = { .fd = -1 };
+
+/* Copy period into ring, drop it if there is no space */
+static void tap_write(struct tap_ring *t, const char *data, int frames)
+{
+    unsigned int head = t->head;
+    unsigned int tail = __atomic_load_n(&t->tail, __ATOMIC_ACQUIRE);
+    int i;
+
+    if (t->size - (head - tail) < (unsigned int)frames) {
+        __atomic_store_n(&t->dropped, t->dropped + frames, __ATOMIC_RELAXED);
+        return;
+    }
+    for (i = 0; i < frames; i++) {
+        t->buffer[(head + i) & (t->size - 1)] = ((const s16 *)data)[i];
+    }
+    __atomic_store_n(&t->head, head + frames, __ATOMIC_RELEASE);
+}
+
+static unsigned int tap_avail(struct tap_ring *t)
+{
+    return __atomic_load_n(&t->head, __ATOMIC_ACQUIRE) - t->tail;
+}
+
+/* i-th frame after tail, silence if there are only avail frames */
+static s16 tap_peek(struct tap_ring *t, unsigned int i, unsigned int avail)
+{
+    return i < avail ? t->buffer[(t->tail + i) & (t->size - 1)] : 0;
+}
+
+/* Give up to n frames back to the producer */
+static void tap_consume(struct tap_ring *t, unsigned int *avail,
+                        unsigned int n)
+{
+    if (n > *avail) {
+        n = *avail;
+    }
+    *avail -= n;
+    __atomic_store_n(&t->tail, t->tail + n, __ATOMIC_RELEASE);
+}
+
+static void put_le32(unsigned char *p, unsigned int v)
+{
+    p[0] = v;
+    p[1] = v >> 8;
+    p[2] = v >> 16;
+    p[3] = v >> 24;
+}
+
+/* WAV header for given number of stereo S16_LE 8000Hz frames. It's
+   rewritten after every batch, so the file is valid even if we get
+   killed. */
+static void record_header(struct recorder *r)
+{
+    unsigned char h[44];
+    unsigned int bytes = r->frames * 4;
+
+    memcpy(h, "RIFF\0\0\0\0WAVEfmt \20\0\0\0\1\0\2\0"
+           "\0\0\0\0\0\0\0\0\4\0\20\0data\0\0\0\0", 44);
+    put_le32(h + 4, 36 + bytes);
+    put_le32(h + 24, 8000);
+    put_le32(h + 28, 8000 * 4);
+    put_le32(h + 40, bytes);
+    if (pwrite(r->fd, h, sizeof(h), 0) != sizeof(h)) {
+        log_msg("call recording header write failed\n");
+    }
+}
+
+static void record_open(struct recorder *r, int call)
+{
+    char path[256];
+    char stamp[32];
+    time_t t = time(0);
+
+    strftime(stamp, sizeof(stamp), "%Y%m%d-%H%M%S", localtime(&t));
+    snprintf(path, sizeof(path), "%s/call-%s.wav", r->dir, stamp);
+    r->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    r->file_call = call;
+    r->frames = 0;
+    if (r->fd < 0) {
+        log_msg("failed to open %s: %s\n", path, strerror(errno));
+        return;
+    }
+    record_header(r);
+    lseek(r->fd, 44, SEEK_SET);
+    log_msg("recording call to %s\n", path);
+}
+
+/* Write what's in rings, all = also frames the other side has no pair
+   for */
+static void record_drain(struct recorder *r, int all)
+{
+    unsigned int up = tap_avail(&r->uplink);
+    unsigned int down = tap_avail(&r->downlink);
+    unsigned int n;
+    unsigned int i;
+
+    for (;;) {
+        n = up < down ? up : down;
+        if (all || up > r->uplink.size / 2 || down > r->downlink.size / 2) {
+            n = up > down ? up : down;
+        }
+        if (n == 0) {
+            return;
+        }
+        if (n > r->uplink.size) {
+            n = r->uplink.size;
+        }
+        for (i = 0; i < n; i++) {
+            r->batch[2 * i] = tap_peek(&r->uplink, i, up);
+            r->batch[2 * i + 1] = tap_peek(&r->downlink, i, down);
+        }
+        tap_consume(&r->uplink, &up, n);
+        tap_consume(&r->downlink, &down, n);
+        if (r->fd < 0) {
+            continue;
+        }
+        if (write(r->fd, r->batch, n * 4) != (ssize_t) (n * 4)) {
+            log_msg("call recording write failed: %s\n", strerror(errno));
+            close(r->fd);
+            r->fd = -1;
+            continue;
+        }
+        r->frames += n;
+        record_header(r);
+    }
+}
+
+static void record_close(struct recorder *r)
+{
+    record_drain(r, 1);
+    if (r->fd >= 0) {
+        log_msg("call recorded, %u frames, dropped %u uplink %u downlink\n",
+                r->frames, __atomic_load_n(&r->uplink.dropped,
+                                           __ATOMIC_RELAXED),
+                __atomic_load_n(&r->downlink.dropped, __ATOMIC_RELAXED));
+        close(r->fd);
+        r->fd = -1;
+    }
+}
+
+static void *record_thread(void *arg)
+{
+    struct recorder *r = &recorder;
+    struct timespec ts = { 0, RECORD_FLUSH_MS * 1000000L };
+    int call;
+
+    while (!__atomic_load_n(&r->stop, __ATOMIC_ACQUIRE)) {
+        if (__atomic_load_n(&r->recording, __ATOMIC_ACQUIRE)) {
+            call = __atomic_load_n(&r->call, __ATOMIC_RELAXED);
+            if (r->file_call != call) {
+                record_close(r);
+                record_open(r, call);
+            }
+            record_drain(r, 0);
+        } else {
+            call = __atomic_load_n(&r->call, __ATOMIC_RELAXED);
+            if (r->done != call) {
+                record_close(r);
+                __atomic_store_n(&r->done, call, __ATOMIC_RELEASE);
+            }
+        }
+        nanosleep(&ts, 0);
+    }
+    record_close(r);
+    return 0;
+}
+
+/* Start writer thread, before the process gets realtime priority. Rings
+   are set by record_init() once arena exists. */
+static void record_start(const char *dir)
+{
+    recorder.dir = dir;
+    if (helper_thread_create(&recorder.thread, record_thread)) {
+        log_msg("failed to create call recording thread\n");
+        recorder.dir = 0;
+        return;
+    }
+    __atomic_store_n(&recorder.running, 1, __ATOMIC_RELEASE);
+}
+
+static void record_stop()
+{
+    if (!__atomic_load_n(&recorder.running, __ATOMIC_ACQUIRE)) {
+        return;
+    }
+    __atomic_store_n(&recorder.stop, 1, __ATOMIC_RELEASE);
+    pthread_join(recorder.thread, 0);
+    recorder.running = 0;
+}
+
+/* Bytes record_init() takes from arena */
+static size_t record_memory()
+{
+    if (recorder.dir == 0) {
+        return 0;
+    }
+    return 4 * ARENA_BLOCK(RECORD_RING_FRAMES * sizeof(s16));
+}
+
+static int record_init()
+{
+    recorder.uplink.size = RECORD_RING_FRAMES;
+    recorder.downlink.size = RECORD_RING_FRAMES;
+    recorder.uplink.buffer = (s16 *) arena_alloc(&arena, RECORD_RING_FRAMES *
+                                                 sizeof(s16));
+    recorder.downlink.buffer = (s16 *) arena_alloc(&arena, RECORD_RING_FRAMES *
+                                                   sizeof(s16));
+    recorder.batch = (s16 *) arena_alloc(&arena, 2 * RECORD_RING_FRAMES *
+                                         sizeof(s16));
+    if (!recorder.uplink.buffer || !recorder.downlink.buffer ||
+        !recorder.batch) {
+        return ERR_BUFFER_ALLOC_FAILED;
+    }
+    return 0;
+}
+
+/* Tap playback streams for this call */
+static void record_begin(struct route_stream *up, struct route_stream *down)
+{
+    if (!__atomic_load_n(&recorder.running, __ATOMIC_ACQUIRE) ||
+        recorder.batch == 0) {
+        return;
+    }
+    up->tap = &recorder.uplink;
+    down->tap = &recorder.downlink;
+    __atomic_store_n(&recorder.uplink.dropped, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&recorder.downlink.dropped, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&recorder.call, recorder.call + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&recorder.recording, 1, __ATOMIC_RELEASE);
+}
+
+/* Streams are closed, wait until the file is finished */
+static void record_end(struct route_stream *up, struct route_stream *down)
+{
+    struct timespec ts = { 0, 10 * 1000000L };
+    int waited_ms = 0;
+
+    up->tap = down->tap = 0;
+    if (!__atomic_load_n(&recorder.recording, __ATOMIC_ACQUIRE)) {
+        return;
+    }
+    __atomic_store_n(&recorder.recording, 0, __ATOMIC_RELEASE);
+    while (__atomic_load_n(&recorder.done, __ATOMIC_ACQUIRE) != recorder.call &&
+           waited_ms < RECORD_CLOSE_MS) {
+        nanosleep(&ts, 0);
+        waited_ms += 10;
+    }
+}
+
+/* Record another period and sound card delay after it */
+static void stats_period(struct route_stream *s)
+{
+    struct stream_stats *st = &(s->stats);
+    snd_pcm_sframes_t delay;
+
+    st->periods++;
+    if (snd_pcm_delay(s->handle, &delay) < 0) {
+        return;
+    }
+    delay /= s->rate_factor;
+    s->delay = delay;
+    if (st->delay_count == 0 || delay < st->delay_min) {
+        st->delay_min = delay;
+    }
+    if (st->delay_count == 0 || delay > st->delay_max) {
+        st->delay_max = delay;
+    }
+    st->delay_sum += delay;
+    st->delay_count++;
+}
+
+/* Resampler can give a frame less than expected, repeat the last one */
+static void fill_tail(s16 *buf, spx_uint32_t done, spx_uint32_t frames)
+{
+    s16 last = done > 0 ? buf[done - 1] : 0;
+
+    while (done < frames) {
+        buf[done++] = last;
+    }
+}
+
+/* Card period in hw_buffer to period_buffer, recording takes the first
+   channel */
+static void convert_from_card(struct route_stream *s)
+{
+    s16 *mono = s->resampler ? s->rate_buffer : (s16 *) s->period_buffer;
+    spx_uint32_t in_len = s->hw_period_size;
+    spx_uint32_t out_len = s->period_size;
+    const int *in32 = (const int *)s->hw_buffer;
+    const s16 *in16 = (const s16 *)s->hw_buffer;
+    unsigned int ch = s->channels;
+    unsigned int i;
+
+    if (s->format == SND_PCM_FORMAT_S32_LE) {
+        for (i = 0; i < s->hw_period_size; i++) {
+            mono[i] = in32[i * ch] >> 16;
+        }
+    } else if (s->format == SND_PCM_FORMAT_S24_LE) {
+        for (i = 0; i < s->hw_period_size; i++) {
+            mono[i] = (int)((unsigned int)in32[i * ch] << 8) >> 16;
+        }
+    } else {
+        for (i = 0; i < s->hw_period_size; i++) {
+            mono[i] = in16[i * ch];
+        }
+    }
+
+    if (s->resampler) {
+        speex_resampler_process_int(s->resampler, 0, mono, &in_len,
+                                    (spx_int16_t *) s->period_buffer,
+                                    &out_len);
+        fill_tail((s16 *) s->period_buffer, out_len, s->period_size);
+    }
+}
+
+/* Period from period_buffer to card format in hw_buffer, same sample to
+   all channels */
+static void convert_to_card(struct route_stream *s)
+{
+    const s16 *mono = (const s16 *)s->period_buffer;
+    spx_uint32_t in_len = s->period_size;
+    spx_uint32_t out_len = s->hw_period_size;
+    int *out32 = (int *)s->hw_buffer;
+    s16 *out16 = (s16 *) s->hw_buffer;
+    unsigned int ch = s->channels;
+    unsigned int i;
+    unsigned int j;
+
+    if (s->resampler) {
+        speex_resampler_process_int(s->resampler, 0, mono, &in_len,
+                                    s->rate_buffer, &out_len);
+        fill_tail(s->rate_buffer, out_len, s->hw_period_size);
+        mono = s->rate_buffer;
+    }
+
+    for (i = 0; i < s->hw_period_size; i++) {
+        for (j = 0; j < ch; j++) {
+            if (s->format == SND_PCM_FORMAT_S32_LE) {
+                out32[i * ch + j] = mono[i] * 65536;
+            } else if (s->format == SND_PCM_FORMAT_S24_LE) {
+                out32[i * ch + j] = mono[i] * 256;
+            } else {
+                out16[i * ch + j] = mono[i];
+            }
+        }
+    }
+}
+
+/* Played period goes to echo history and call recording */
+static void route_stream_played(struct route_stream *s, const char *data)
+{
+    if (s->history) {
+        echo_history_write(s->history, data, s->period_size, s->delay);
+    }
+    if (s->tap) {
+        tap_write(s->tap, data, s->period_size);
+    }
+}
+
+/* Write one card period, mmap streams too */
+static snd_pcm_sframes_t route_stream_writei(struct route_stream *s,
+                                             const char *data)
+{
+    if (s->mmap) {
+        return snd_pcm_mmap_writei(s->handle, data, s->hw_period_size);
+    }
+    return snd_pcm_writei(s->handle, data, s->hw_period_size);
+}
+
+/* Periods playback is primed with, at most the whole buffer */
+static int route_stream_fill(struct route_stream *s)
+{
+    int max = s->buffer_size / s->period_size;
+
+    return s->xrun_fill < max ? s->xrun_fill : max;
+}
+
+/* Write periods of silence to prepared or running playback. Returns 0
+   if all were written. */
+static int route_stream_prime(struct route_stream *s, int periods)
+{
+    int i;
+
+    for (i = 0; i < periods; i++) {
+        if (route_stream_writei(s, s->silence) !=
+            (snd_pcm_sframes_t) s->hw_period_size) {
+            return -1;
+        }
+        route_stream_played(s, s->silence);
+    }
+    return 0;
+}
+
+static int route_stream_read(struct route_stream *s)
+{
+    int rc;
+
+    if (terminating) {
+        return ERR_TERMINATING;
+    }
+
+    if (s->mmap) {
+        rc = route_stream_mmap_read(s);
+    } else if (s->hw_buffer) {
+        rc = snd_pcm_readi(s->handle, s->hw_buffer, s->hw_period_size);
+    } else {
+        rc = snd_pcm_readi(s->handle, s->period_buffer, s->period_size);
+    }
+    if (rc == s->hw_period_size) {
+        if (s->hw_buffer) {
+            convert_from_card(s);
+        }
+        stats_period(s);
+        return 0;
+    }
+
+    /* No data yet in non-blocking mode */
+    if (rc == -EAGAIN) {
+        return ERR_AGAIN;
+    }
+
+    /* EPIPE means overrun */
+    if (rc == -EPIPE) {
+        s->stats.xruns++;
+        err("overrun occured", rc, s, ERR_READ_OVERRUN);
+        snd_pcm_prepare(s->handle);
+        if (s->link) {
+            /* Linked playback was stopped and prepared with us, start both
+               again with playback primed */
+            route_stream_prime(s->link, route_stream_fill(s->link));
+            snd_pcm_start(s->handle);
+        } else if (s->nonblock) {
+            /* Nobody would start it by blocking read */
+            snd_pcm_start(s->handle);
+        }
+        return ERR_READ_OVERRUN;
+    }
+
+    if (rc < 0) {
+        s->stats.errors++;
+        return err("snd_pcm_readi failed", rc, s, ERR_READ);
+    }
+
+    s->stats.short_io++;
+    return err("short read", rc, s, ERR_SHORT_READ);
+}
+
+/* Underrun - prepare the stream and fill it with xrun_fill - 1 periods of
+   silence and the period which did not fit, then start it right away
+   instead of waiting until start_threshold is reached. Linked capture was
+   stopped with us and starts again too. Returns 0 if the period was
+   played. */
+static int route_stream_recover(struct route_stream *s)
+{
+    int fill = route_stream_fill(s);
+    snd_pcm_sframes_t rc;
+    const char *period;
+
+    rc = snd_pcm_prepare(s->handle);
+    if (rc < 0 || fill <= 0) {
+        return -1;
+    }
+
+    /* In mmap mode period_buffer can point to the area we just lost */
+    if (s->hw_buffer) {
+        period = s->hw_buffer;
+    } else {
+        if (s->period_buffer != s->own_buffer) {
+            memcpy(s->own_buffer, s->period_buffer, s->period_buffer_size);
+            s->period_buffer = s->own_buffer;
+        }
+        period = s->period_buffer;
+    }
+
+    if (route_stream_prime(s, fill - 1)) {
+        return -1;
+    }
+    rc = route_stream_writei(s, period);
+    if (rc != s->hw_period_size) {
+        return -1;
+    }
+    if (snd_pcm_state(s->handle) == SND_PCM_STATE_PREPARED &&
+        snd_pcm_start(s->handle) < 0) {
+        return -1;
+    }
+
+    stats_period(s);
+    route_stream_played(s, s->period_buffer);
+    log_msg("%s: restarted with %d periods\n", s->id, fill);
+    return 0;
+}
+
+static int route_stream_write(struct route_stream *s)
+{
+    int rc;
+
+    if (terminating) {
+        return ERR_TERMINATING;
+    }
+
+    if (s->mmap) {
+        rc = route_stream_mmap_write(s);
+    } else if (s->hw_buffer) {
+        /* Converted only once, even if it's written again after EAGAIN */
+        if (!s->hw_ready) {
+            convert_to_card(s);
+            s->hw_ready = 1;
+        }
+        rc = snd_pcm_writei(s->handle, s->hw_buffer, s->hw_period_size);
+        if (rc != -EAGAIN) {
+            s->hw_ready = 0;
+        }
+    } else {
+        rc = snd_pcm_writei(s->handle, s->period_buffer, s->period_size);
+    }
+    if (rc == s->hw_period_size) {
+        stats_period(s);
+        route_stream_played(s, s->period_buffer);
+        return 0;
+    }
+
+    /* No space yet in non-blocking mode */
+    if (rc == -EAGAIN) {
+        return ERR_AGAIN;
+    }
+
+    /* EPIPE means underrun */
+    if (rc == -EPIPE) {
+        s->stats.xruns++;
+        err("underrun occured", rc, s, ERR_WRITE_UNDERRUN);
+        if (route_stream_recover(s) == 0) {
+            return 0;
+        }
+        return ERR_WRITE_UNDERRUN;
+    }
+
+    if (rc < 0) {
+        s->stats.errors++;
+        return err("snd_pcm_writei failed", rc, s, ERR_WRITE);
+    }
+
+    s->stats.short_io++;
+    return err("short write", rc, s, ERR_SHORT_WRITE);
+}
+
+/* Link capture and playback of one card and start them together with the
+   playback primed, so the phase between them is the same in every call.
+   From then on they are started, stopped and prepared together. */
+static void route_stream_link(struct route_stream *c, struct route_stream *p)
+{
+    snd_pcm_sframes_t c_delay = 0;
+    snd_pcm_sframes_t p_delay = 0;
+    int fill = route_stream_fill(p) > 0 ? route_stream_fill(p) : 1;
+    int rc;
+
+    rc = snd_pcm_link(c->handle, p->handle);
+    if (rc < 0) {
+        err("snd_pcm_link failed", rc, c, 0);
+        return;
+    }
+    c->link = p;
+    p->link = c;
+
+    if (route_stream_prime(p, fill)) {
+        err("priming linked playback failed", 0, p, 0);
+        return;
+    }
+    rc = snd_pcm_start(c->handle);
+    if (rc < 0) {
+        err("linked start failed", rc, c, 0);
+        return;
+    }
+    snd_pcm_delay(c->handle, &c_delay);
+    snd_pcm_delay(p->handle, &p_delay);
+    log_msg("%s+%s: linked, started with %s delay %ld, %s delay %ld frames\n",
+            c->id, p->id, c->id, (long)(c_delay / c->rate_factor), p->id,
+            (long)(p_delay / p->rate_factor));
+}
+
+/* Linked playback has to be fed already before the routing starts, with
+   silence in pace of its capture */
+static void route_stream_keep_primed(struct route_stream *s)
+{
+    if (s->link && snd_pcm_state(s->handle) == SND_PCM_STATE_RUNNING) {
+        route_stream_prime(s, 1);
+    }
+}
+
+/* Jitter buffer - queue of periods in front of playback stream */
+struct jitter_buffer
+{
+    s16 *periods;               // ring of max + 1 periods
+    s16 *last;                  // last period played, used for concealment
+    int slots;                  // number of periods in ring
+    int period_size;            // frames in period
+    int head;                   // slot to be played next
+    int count;                  // periods in buffer
+    int target;                 // periods to collect before playing
+    int max;                    // max periods, over it the oldest are dropped
+    int playing;                // target was reached once
+    int lost;                   // periods concealed in row
+    int above_target;           // pulls in row with more than target periods
+    unsigned int concealed;     // total concealed periods
+    unsigned int dropped;       // total dropped periods
+};
+
+struct jitter_buffer p0_jitter;
+struct jitter_buffer p1_jitter;
+
+/* Clock drift compensation for playback stream. Periods are resampled into
+   fifo from which they are played. */
+struct drift_comp
+{
+    SpeexResamplerState *resampler;
+    s16 *fifo;                  // resampled frames waiting to be played
+    int fifo_frames;            // frames in fifo
+    int fifo_size;              // fifo capacity in frames
+    double target;              // wanted frames in fifo and sound card, 0 = level at start
+    double drift_ppm;           // estimated clock difference
+    int ppm;                    // current correction, > 0 means playing less frames than recorded
+    double level_sum;           // sum of levels measured in this interval
+    int level_count;            // number of levels measured in this interval
+    double last_level;          // average level in previous interval, < 0 if none
+    int intervals;              // number of finished intervals
+};
+
+struct drift_comp p0_drift;
+struct drift_comp p1_drift;
+
+/* Fifo and resampler are kept from previous call if possible */
+static int drift_init(struct drift_comp *d, struct route_stream *s,
+                      double target)
+{
+    SpeexResamplerState *resampler = d->resampler;
+    s16 *fifo = d->fifo;
+    int fifo_size = d->fifo_size;
+    int rc;
+
+    memset(d, 0, sizeof(*d));
+    d->fifo_size = 4 * s->period_size;
+    d->fifo = fifo;
+    if (d->fifo == 0 || fifo_size != d->fifo_size) {
+        d->fifo = (s16 *) arena_alloc(&arena, d->fifo_size * sizeof(s16));
+    }
+    if (d->fifo == 0) {
+        return ERR_BUFFER_ALLOC_FAILED;
+    }
+    if (resampler) {
+        speex_resampler_reset_mem(resampler);
+        speex_resampler_set_rate_frac(resampler, 1000000, 1000000, 8000, 8000);
+    } else {
+        resampler = speex_resampler_init(1, 8000, 8000,
+                                         SPEEX_RESAMPLER_QUALITY_VOIP, &rc);
+    }
+    d->resampler = resampler;
+    if (d->resampler == 0) {
+        return ERR_BUFFER_ALLOC_FAILED;
+    }
+    d->target = target;
+    d->last_level = -1;
+    s->drift = d;
+    return 0;
+}
+
+/* Fifo is part of arena, only resampler is freed */
+static void drift_destroy(struct drift_comp *d)
+{
+    if (d->resampler) {
+        speex_resampler_destroy(d->resampler);
+        d->resampler = 0;
+    }
+    d->fifo = 0;
+}
+
+/* Measure playback level and adjust resampling ratio. Levels are averaged
+   over ~2s intervals. Change of the level between intervals tells us how much
+   the clocks differ on top of the correction we already apply. Besides
+   following the drift we slowly (in ~10s) move the level back to target. */
+static void drift_update(struct drift_comp *d, struct route_stream *s)
+{
+    int interval = 2 * 8000 / s->period_size;
+    snd_pcm_sframes_t delay;
+    double level;
+    double drift;
+    double ppm;
+
+    if (snd_pcm_delay(s->handle, &delay) < 0) {
+        return;
+    }
+    d->level_sum += delay / s->rate_factor + d->fifo_frames;
+    if (s->jitter) {
+        d->level_sum += s->jitter->count * s->period_size;
+    }
+    if (++(d->level_count) < interval) {
+        return;
+    }
+
+    level = d->level_sum / d->level_count;
+    if (d->target <= 0) {
+        d->target = level;
+    }
+    if (d->last_level >= 0) {
+        drift = d->ppm + (level - d->last_level) * 1000000 /
+            (d->level_count * s->period_size);
+        d->drift_ppm += 0.1 * (drift - d->drift_ppm);
+    }
+    d->last_level = level;
+    d->level_sum = 0;
+    d->level_count = 0;
+
+    ppm = d->drift_ppm + (level - d->target) * 1000000 / (10 * 8000);
+    if (ppm > DRIFT_MAX_PPM) {
+        ppm = DRIFT_MAX_PPM;
+    } else if (ppm < -DRIFT_MAX_PPM) {
+        ppm = -DRIFT_MAX_PPM;
+    }
+    if ((int)ppm != d->ppm) {
+        d->ppm = (int)ppm;
+        speex_resampler_set_rate_frac(d->resampler, 1000000, 1000000 - d->ppm,
+                                      8000, 8000);
+    }
+
+    if (++(d->intervals) % 30 == 0) {
+        log_msg("%s: level %d frames (target %d), drift %d ppm\n",
+                s->id, (int)level, (int)d->target, d->ppm);
+    }
+}
+
+/* Resample processed period from period_buffer into drift compensation
+   fifo */
+static void route_stream_queue(struct route_stream *s)
+{
+    struct drift_comp *d = s->drift;
+    spx_uint32_t in_len = s->period_size;
+    spx_uint32_t out_len;
+
+    drift_update(d, s);
+
+    /* Playback is stuck, drop the oldest period */
+    if (d->fifo_size - d->fifo_frames < s->period_size + s->period_size / 8) {
+        d->fifo_frames -= s->period_size;
+        memmove(d->fifo, d->fifo + s->period_size,
+                d->fifo_frames * sizeof(s16));
+    }
+
+    out_len = d->fifo_size - d->fifo_frames;
+    speex_resampler_process_int(d->resampler, 0,
+                                (spx_int16_t *) s->period_buffer, &in_len,
+                                (spx_int16_t *) d->fifo + d->fifo_frames,
+                                &out_len);
+    d->fifo_frames += out_len;
+}
+
+/* Play whole periods waiting in drift compensation fifo */
+static int route_stream_flush(struct route_stream *s)
+{
+    struct drift_comp *d = s->drift;
+    int rc = 0;
+
+    while (d->fifo_frames >= s->period_size) {
+        memcpy(s->period_buffer, d->fifo, s->period_buffer_size);
+        rc = route_stream_write(s);
+        if (rc == ERR_AGAIN) {
+            break;
+        }
+        /* Played or lost in underrun, it's gone in both cases */
+        d->fifo_frames -= s->period_size;
+        memmove(d->fifo, d->fifo + s->period_size,
+                d->fifo_frames * sizeof(s16));
+    }
+    return rc;
+}
+
+/* Play processed period from period_buffer */
+static int route_stream_play(struct route_stream *s)
+{
+    if (s->drift == 0) {
+        return route_stream_write(s);
+    }
+    route_stream_queue(s);
+    return route_stream_flush(s);
+}
+
+/* Max periods in jitter buffer */
+static int jitter_max(int period_size, int target_ms, int max_ms)
+{
+    int period_ms_x8 = period_size;     // period length in ms * 8
+    int target = (target_ms * 8 + period_ms_x8 - 1) / period_ms_x8;
+    int max = (max_ms * 8 + period_ms_x8 - 1) / period_ms_x8;
+
+    return max <= target ? target + 1 : max;
+}
+
+/* Periods are kept from previous call if they have the same size */
+static int jitter_init(struct jitter_buffer *jb, struct route_stream *s,
+                       int target_ms, int max_ms)
+{
+    int period_ms_x8 = s->period_size;     // period length in ms * 8
+    s16 *periods = jb->periods;
+    s16 *last = jb->last;
+    int old_frames = jb->slots * jb->period_size;
+    int old_period = jb->period_size;
+
+    memset(jb, 0, sizeof(*jb));
+    jb->period_size = s->period_size;
+    jb->target = (target_ms * 8 + period_ms_x8 - 1) / period_ms_x8;
+    jb->max = jitter_max(s->period_size, target_ms, max_ms);
+    jb->slots = jb->max + 1;
+    jb->periods = periods;
+    jb->last = last;
+    if (jb->periods == 0 || old_frames != jb->slots * jb->period_size) {
+        jb->periods = (s16 *) arena_alloc(&arena, jb->slots *
+                                          jb->period_size * sizeof(s16));
+    }
+    if (jb->last == 0 || old_period != jb->period_size) {
+        jb->last = (s16 *) arena_alloc(&arena, jb->period_size * sizeof(s16));
+    } else {
+        memset(jb->last, 0, jb->period_size * sizeof(s16));
+    }
+    if (jb->periods == 0 || jb->last == 0) {
+        return ERR_BUFFER_ALLOC_FAILED;
+    }
+    s->jitter = jb;
+    log_msg("%s: jitter buffer target %d, max %d periods\n", s->id,
+            jb->target, jb->max);
+    return 0;
+}
+
+static void jitter_drop(struct jitter_buffer *jb)
+{
+    jb->head = (jb->head + 1) % jb->slots;
+    jb->count--;
+    jb->dropped++;
+}
+
+static void jitter_push(struct jitter_buffer *jb, const char *period)
+{
+    int tail;
+
+    if (jb->count >= jb->max) {
+        jitter_drop(jb);
+    }
+    tail = (jb->head + jb->count) % jb->slots;
+    memcpy(jb->periods + tail * jb->period_size, period,
+           jb->period_size * sizeof(s16));
+    jb->count++;
+}
+
+/* Get period to be played now. Returns 0 if we are still collecting periods
+   at start and there is nothing to play. */
+static int jitter_pull(struct jitter_buffer *jb, char *period)
+{
+    s16 *out = (s16 *) period;
+
+    if (!jb->playing) {
+        if (jb->count < jb->target || jb->count == 0) {
+            return 0;
+        }
+        jb->playing = 1;
+    }
+
+    /* Nothing arrived in time, repeat last period quieter, then silence */
+    if (jb->count == 0) {
+        if (jb->lost < JITTER_CONCEAL_MAX) {
+            jb->lost++;
+            memcpy(out, jb->last, jb->period_size * sizeof(s16));
+            dsp_gain(out, jb->period_size, DSP_GAIN_ONE >> jb->lost);
+        } else {
+            dsp_silence(out, jb->period_size);
+        }
+        jb->concealed++;
+        return 1;
+    }
+
+    /* Keep latency at target */
+    if (jb->count > jb->target && jb->count > 1) {
+        if (++(jb->above_target) > JITTER_ABOVE_TARGET_MAX) {
+            jitter_drop(jb);
+            jb->above_target = 0;
+        }
+    } else {
+        jb->above_target = 0;
+    }
+
+    memcpy(out, jb->periods + jb->head * jb->period_size,
+           jb->period_size * sizeof(s16));
+    memcpy(jb->last, out, jb->period_size * sizeof(s16));
+    jb->head = (jb->head + 1) % jb->slots;
+    jb->count--;
+    jb->lost = 0;
+    return 1;
+}
+
+/* Play period processed into period_buffer (have_period=1) or nothing if the
+   period is missing. With jitter buffer the period is queued and the one due
+   now (or concealment) is played instead. Returns 1 if period_buffer was
+   played. */
+static int route_stream_deliver(struct route_stream *s, int have_period)
+{
+    if (s->jitter == 0) {
+        if (have_period) {
+            route_stream_play(s);
+        }
+        return have_period;
+    }
+    if (have_period) {
+        jitter_push(s->jitter, s->period_buffer);
+    }
+    if (!jitter_pull(s->jitter, s->period_buffer)) {
+        return 0;
+    }
+    route_stream_play(s);
+    return 1;
+}
+
+/* Aux leds.
+
+   Brightness files are opened once and written by helper thread with normal
+   priority. set_aux_leds() only stores the wanted state into mailbox and
+   helper picks up the latest one every LED_POLL_MS, so fast changes (walkie
+   talkie can switch every period) are coalesced and routing threads make no
+   syscalls for leds. Without helper (before led_start() and after
+   led_stop()) leds are written directly. */
+#define LED_RED 1
+#define LED_GREEN 2
+
+struct led_helper
+{
+    int red_fd;                 // brightness of red aux led or -1
+    int green_fd;               // brightness of green aux led or -1
+    int wanted;                 // mailbox, LED_RED | LED_GREEN
+    int shown;                  // state the leds have, -1 if unknown
+    int running;                // helper thread is running
+    int stop;                   // helper should finish
+    pthread_t thread;
+};
+
+struct led_helper leds = { .red_fd = -1, .green_fd = -1, .shown = -1 };
+
+int aux_red_state = 0;
+int aux_green_state = 0;
+
+static void write_led(int fd, int on)
+{
+    if (fd >= 0) {
+        pwrite(fd, on ? "255" : "0", on ? 3 : 1, 0);
+    }
+}
+
+static void show_leds(int state)
+{
+    if (state == leds.shown) {
+        return;
+    }
+    write_led(leds.red_fd, state & LED_RED);
+    write_led(leds.green_fd, state & LED_GREEN);
+    leds.shown = state;
+}
+
+static void *led_thread(void *arg)
+{
+    struct timespec ts = { 0, LED_POLL_MS * 1000000L };
+
+    while (!__atomic_load_n(&leds.stop, __ATOMIC_ACQUIRE)) {
+        show_leds(__atomic_load_n(&leds.wanted, __ATOMIC_ACQUIRE));
+        nanosleep(&ts, 0);
+    }
+    show_leds(__atomic_load_n(&leds.wanted, __ATOMIC_ACQUIRE));
+    return 0;
+}
+
+/* Open leds and start helper, before the process gets realtime priority */
+static void led_start()
+{
+    leds.red_fd = open("/sys/class/leds/gta04:red:aux/brightness",
+                       O_WRONLY | O_CLOEXEC);
+    leds.green_fd = open("/sys/class/leds/gta04:green:aux/brightness",
+                         O_WRONLY | O_CLOEXEC);
+    if (leds.red_fd < 0 && leds.green_fd < 0) {
+        return;
+    }
+    leds.stop = 0;
+    if (helper_thread_create(&leds.thread, led_thread)) {
+        log_msg("failed to create led thread\n");
+        return;
+    }
+    __atomic_store_n(&leds.running, 1, __ATOMIC_RELEASE);
+}
+
+/* Show the last wanted state and close leds */
+static void led_stop()
+{
+    if (__atomic_load_n(&leds.running, __ATOMIC_ACQUIRE)) {
+        __atomic_store_n(&leds.stop, 1, __ATOMIC_RELEASE);
+        pthread_join(leds.thread, 0);
+        leds.running = 0;
+    }
+    show_leds(leds.wanted);
+    if (leds.red_fd >= 0) {
+        close(leds.red_fd);
+    }
+    if (leds.green_fd >= 0) {
+        close(leds.green_fd);
+    }
+    leds.red_fd = leds.green_fd = -1;
+}
+
+static void set_aux_leds(int red, int green)
+{
+    int state = (red ? LED_RED : 0) | (green ? LED_GREEN : 0);
+
+    aux_red_state = red;
+    aux_green_state = green;
+    __atomic_store_n(&leds.wanted, state, __ATOMIC_RELEASE);
+    if (!__atomic_load_n(&leds.running, __ATOMIC_ACQUIRE)) {
+        show_leds(state);
+    }
+}
+
+static void blink_aux()
+{
+    static int last_blink_secs;
+
+    struct timespec tp;
+    clock_gettime(CLOCK_MONOTONIC, &tp);
+
+    if (tp.tv_sec == last_blink_secs) {
+        return;
+    }
+    last_blink_secs = tp.tv_sec;
+    set_aux_leds(!aux_red_state, aux_red_state);
+}
+
+/* Show walkie talkie state on aux leds */
+static void show_echo_state(int state)
+{
+    if (state == ECHO_LISTENING) {
+        set_aux_leds(0, 1);
+    } else if (state == ECHO_TALKING) {
+        set_aux_leds(1, 0);
+    } else if (state == ECHO_NONE) {
+        set_aux_leds(0, 0);
+    }
+}
+
+static void show_progress()
 {
 /*   static int counter = 0;
     char ch = "|\\-/"[(counter++) % 4];
@@ -407,165 +2522,1845 @@ static void show_progress()
     fflush(logfile);*/
 }
 
-#ifdef USE_WALKIE_TALKIE_AEC
+struct route_stream p0 = {
+    .id = "p0",
+    .pcm_name = "default",
+    .stream = SND_PCM_STREAM_PLAYBACK,
+    .start_threshold = 1024,
+    .stop_threshold = 1024,
+    .buffer_size = 1024,
+    .period_size = 256,
+    .rate = 8000,
+    .format = SND_PCM_FORMAT_S16_LE,
+    .channels = 1,
+    .handle = 0,
+    .period_buffer = 0
+};
+
+struct route_stream r0 = {
+    .id = "r0",
+    .pcm_name = "default",
+    .stream = SND_PCM_STREAM_CAPTURE,
+    .start_threshold = 0,
+    .stop_threshold = 0,
+    .buffer_size = 1024,
+    .period_size = 256,
+    .rate = 8000,
+    .format = SND_PCM_FORMAT_S16_LE,
+    .channels = 1,
+    .handle = 0,
+    .period_buffer = 0
+};
+
+struct route_stream p1 = {
+    .id = "p1",
+    .pcm_name = "hw:1,0",
+    .stream = SND_PCM_STREAM_PLAYBACK,
+    .start_threshold = 1024,
+    .stop_threshold = 1024,
+    .buffer_size = 1024,
+    .period_size = 256,
+    .rate = 8000,
+    .format = SND_PCM_FORMAT_S16_LE,
+    .channels = 1,
+    .handle = 0,
+    .period_buffer = 0
+};
+
+struct route_stream r1 = {
+    .id = "r1",
+    .pcm_name = "hw:1,0",
+    .stream = SND_PCM_STREAM_CAPTURE,
+    .start_threshold = 0,
+    .stop_threshold = 0,
+    .buffer_size = 1024,
+    .period_size = 256,
+    .rate = 8000,
+    .format = SND_PCM_FORMAT_S16_LE,
+    .channels = 1,
+    .handle = 0,
+    .period_buffer = 0
+};
+
+/* Local endpoint - pcm device r0 and p0 are opened on */
+struct endpoint
+{
+    char name[ENDPOINT_NAME];
+    char pcm_name[ENDPOINT_PCM];
+};
+
+struct endpoint endpoints[MAX_ENDPOINTS] = {
+    { "handset", "default" }
+};
+int endpoint_count = 1;
+int endpoint_current = 0;       // index of endpoint r0 and p0 use
+
+/* Index of endpoint with given name or -1 */
+static int endpoint_find(const char *name)
+{
+    int i;
+
+    for (i = 0; i < endpoint_count; i++) {
+        if (strcmp(endpoints[i].name, name) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/* Parse GSM_VOICE_ROUTING_ENDPOINTS - space separated name=pcm pairs, the
+   first one is used unless GSM_VOICE_ROUTING_ENDPOINT names another */
+static int endpoints_config()
+{
+    char *value = getenv("GSM_VOICE_ROUTING_ENDPOINTS");
+    char copy[MAX_ENDPOINTS * (ENDPOINT_NAME + ENDPOINT_PCM)];
+    char *save = 0;
+    char *item;
+    char *eq;
+
+    if (value && *value) {
+        snprintf(copy, sizeof(copy), "%s", value);
+        endpoint_count = 0;
+        for (item = strtok_r(copy, " \t", &save); item;
+             item = strtok_r(0, " \t", &save)) {
+            eq = strchr(item, '=');
+            if (eq == 0 || eq == item || eq[1] == 0 ||
+                eq - item >= ENDPOINT_NAME || strlen(eq + 1) >= ENDPOINT_PCM ||
+                endpoint_count == MAX_ENDPOINTS) {
+                log_msg("invalid endpoint %s\n", item);
+                return -1;
+            }
+            *eq = 0;
+            snprintf(endpoints[endpoint_count].name, ENDPOINT_NAME, "%s", item);
+            snprintf(endpoints[endpoint_count].pcm_name, ENDPOINT_PCM, "%s",
+                     eq + 1);
+            endpoint_count++;
+        }
+        if (endpoint_count == 0) {
+            log_msg("no endpoints in GSM_VOICE_ROUTING_ENDPOINTS\n");
+            return -1;
+        }
+    }
+
+    value = getenv("GSM_VOICE_ROUTING_ENDPOINT");
+    if (value && *value) {
+        endpoint_current = endpoint_find(value);
+        if (endpoint_current < 0) {
+            log_msg("unknown GSM_VOICE_ROUTING_ENDPOINT=%s\n", value);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static void prefault_stack()
+{
+    char stack[RT_STACK_PREFAULT];
+
+    memset(stack, 0, sizeof(stack));
+    /* Don't let compiler optimize the memset away */
+    __asm__ __volatile__("" : : "r"(stack) : "memory");
+}
+
+/* Make calling thread realtime according to rt_* settings */
+static void make_realtime(const char *name)
+{
+    struct sched_param param;
+    cpu_set_t cpus;
+    int rc;
+
+    if (rt_cpu >= 0) {
+        CPU_ZERO(&cpus);
+        CPU_SET(rt_cpu, &cpus);
+        rc = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+        if (rc) {
+            log_msg("%s: failed to pin to cpu %d: %s\n", name, rt_cpu,
+                    strerror(rc));
+        }
+    }
+
+    if (rt_priority <= 0) {
+        return;
+    }
+
+    prefault_stack();
+
+    memset(&param, 0, sizeof(param));
+    param.sched_priority = rt_priority;
+    rc = pthread_setschedparam(pthread_self(), rt_policy, &param);
+    if (rc) {
+        log_msg("%s: realtime scheduling failed: %s\n", name,
+                strerror(rc));
+        return;
+    }
+    log_msg("%s: running with %s priority %d\n", name,
+            rt_policy == SCHED_RR ? "SCHED_RR" : "SCHED_FIFO", rt_priority);
+}
+
+/* Integer setting from environment or def if not set */
+static int getenv_int(const char *name, int def)
+{
+    char *value = getenv(name);
+    if (value == 0 || *value == 0) {
+        return def;
+    }
+    return atoi(value);
+}
+
+/* Card format of the stream from GSM_VOICE_ROUTING_<STREAM>_RATE, _FORMAT
+   and _CHANNELS, e.g. GSM_VOICE_ROUTING_P0_RATE */
+static int route_stream_config(struct route_stream *s)
+{
+    char prefix[32];
+    char name[48];
+    char *value;
+
+    snprintf(prefix, sizeof(prefix), "GSM_VOICE_ROUTING_%c%c_",
+             toupper(s->id[0]), s->id[1]);
+
+    snprintf(name, sizeof(name), "%sRATE", prefix);
+    s->rate = getenv_int(name, 8000);
+    if (s->rate == 0 || s->rate % 8000 || s->rate > 192000) {
+        log_msg("invalid %s=%u, must be multiple of 8000\n", name, s->rate);
+        return -1;
+    }
+
+    snprintf(name, sizeof(name), "%sCHANNELS", prefix);
+    s->channels = getenv_int(name, 1);
+    if (s->channels < 1 || s->channels > 8) {
+        log_msg("invalid %s=%u\n", name, s->channels);
+        return -1;
+    }
+
+    snprintf(name, sizeof(name), "%sFORMAT", prefix);
+    value = getenv(name);
+    s->format = value && *value ? snd_pcm_format_value(value) :
+        SND_PCM_FORMAT_S16_LE;
+    if (s->format != SND_PCM_FORMAT_S16_LE &&
+        s->format != SND_PCM_FORMAT_S24_LE &&
+        s->format != SND_PCM_FORMAT_S32_LE) {
+        log_msg("invalid %s=%s, use S16_LE, S24_LE or S32_LE\n", name, value);
+        return -1;
+    }
+    return 0;
+}
+
+/* Request given geometry for stream. Playback streams start and stop when
+   the whole buffer is full/empty. */
+static void set_geometry(struct route_stream *s, snd_pcm_uframes_t period,
+                         snd_pcm_uframes_t buffer)
+{
+    s->period_size = period;
+    s->buffer_size = buffer;
+    if (s->stream == SND_PCM_STREAM_PLAYBACK) {
+        s->start_threshold = buffer;
+        s->stop_threshold = buffer;
+    }
+}
+
+/* Statistics of one routing direction */
+struct direction_stats
+{
+    const char *name;
+    struct route_stream *capture;
+    struct route_stream *playback;
+    long long period_us;        // time spent processing current period
+    unsigned int hist[PROC_HIST_BUCKETS];   // processing time histogram
+    unsigned int count;         // processed periods
+    long long sum_us;
+    long long min_us;
+    long long max_us;
+    long long last_report_us;   // when we logged last summary
+};
+
+struct direction_stats uplink_stats = {
+    .name = "uplink",
+    .capture = &r0,
+    .playback = &p1
+};
+
+struct direction_stats downlink_stats = {
+    .name = "downlink",
+    .capture = &r1,
+    .playback = &p0
+};
+
+/* Seconds between summaries, 0 means only at hangup */
+int stats_interval = 0;
+
+/* Print counters of stream into buf */
+static void stream_stats_str(char *buf, int size, struct route_stream *s)
+{
+    struct stream_stats *st = &(s->stats);
+    long delay_avg = st->delay_count ? st->delay_sum / st->delay_count : 0;
+
+    snprintf(buf, size, "%s periods %u xruns %u short %u errors %u "
+             "delay %ld/%ld/%ld", s->id, st->periods, st->xruns, st->short_io,
+             st->errors, (long)st->delay_min, delay_avg, (long)st->delay_max);
+}
+
+/* Print one line summary of direction into buf, returns 0 if the direction
+   processed nothing yet. Can be called from other thread than the one
+   routing the direction, the numbers are then just not from the same
+   moment. */
+static int direction_stats_str(char *buf, int size, struct direction_stats *d)
+{
+    struct route_stream *c = d->capture;
+    struct route_stream *p = d->playback;
+    struct jitter_buffer *jb = p->jitter;
+    struct drift_comp *dc = p->drift;
+    unsigned int count = d->count;
+    char capture_str[128];
+    char playback_str[128];
+    unsigned int p99 = 0;
+    unsigned int sum = 0;
+    long latency;
+    int i;
+
+    if (count == 0) {
+        return 0;
+    }
+
+    for (i = 0; i < PROC_HIST_BUCKETS; i++) {
+        sum += d->hist[i];
+        if (sum * 100ULL >= count * 99ULL) {
+            p99 = (i + 1) * PROC_HIST_US;
+            break;
+        }
+    }
+
+    /* Recorded frames waiting for us, the period itself, frames waiting
+       in our queues and frames queued for playing */
+    latency = c->period_size;
+    if (c->stats.delay_count) {
+        latency += c->stats.delay_sum / c->stats.delay_count;
+    }
+    if (p->stats.delay_count) {
+        latency += p->stats.delay_sum / p->stats.delay_count;
+    }
+    if (jb) {
+        latency += jb->count * p->period_size;
+    }
+    if (dc) {
+        latency += dc->fifo_frames;
+    }
+
+    stream_stats_str(capture_str, sizeof(capture_str), c);
+    stream_stats_str(playback_str, sizeof(playback_str), p);
+    snprintf(buf, size, "%s: %s, %s, proc us %lld/%lld/%u/%lld, "
+             "latency %ld.%ld ms", d->name, capture_str, playback_str,
+             d->min_us, d->sum_us / count, p99, d->max_us, latency / 8,
+             (latency % 8) * 10 / 8);
+    return 1;
+}
+
+/* Log one line summary of direction */
+static void stats_report(struct direction_stats *d)
+{
+    char buf[384];
+
+    if (!direction_stats_str(buf, sizeof(buf), d)) {
+        return;
+    }
+    log_msg("%s\n", buf);
+    if (d->playback->jitter) {
+        log_msg("%s: concealed %u dropped %u periods\n", d->name,
+                d->playback->jitter->concealed, d->playback->jitter->dropped);
+    }
+}
+
+/* Start counting from zero for the next call */
+static void stats_reset(struct direction_stats *d)
+{
+    d->period_us = 0;
+    memset(d->hist, 0, sizeof(d->hist));
+    d->count = 0;
+    d->sum_us = 0;
+    d->min_us = 0;
+    d->max_us = 0;
+    d->last_report_us = 0;
+}
+
+/* Add time spent processing current period since start_us */
+static void stats_add_time(struct direction_stats *d, long long start_us)
+{
+    d->period_us += now_us() - start_us;
+}
+
+/* Current period was processed, record processing time and log summary if
+   it's time */
+static void stats_period_done(struct direction_stats *d)
+{
+    long long us = d->period_us;
+    int bucket = us / PROC_HIST_US;
+    long long now;
+
+    if (bucket >= PROC_HIST_BUCKETS) {
+        bucket = PROC_HIST_BUCKETS - 1;
+    }
+    d->hist[bucket]++;
+    if (d->count == 0 || us < d->min_us) {
+        d->min_us = us;
+    }
+    if (d->count == 0 || us > d->max_us) {
+        d->max_us = us;
+    }
+    d->sum_us += us;
+    d->count++;
+    d->period_us = 0;
+
+    if (stats_interval <= 0) {
+        return;
+    }
+    now = now_us();
+    if (d->last_report_us == 0) {
+        d->last_report_us = now;
+    } else if (now - d->last_report_us >= stats_interval * 1000000LL) {
+        d->last_report_us = now;
+        stats_report(d);
+    }
+}
+
+/* Routing loop stages timed by the profiler */
+#define PROF_POLL 0             // waiting in poll()
+#define PROF_READ_R0 1          // reading r0, including waiting for it
+#define PROF_READ_R1 2
+#define PROF_ECHO_REF 3         // taking echo reference from history
+#define PROF_AEC 4              // echo suppression backend
+#define PROF_COPY 5             // downlink r1 -> p0 copy
+#define PROF_WRITE_P0 6         // playing, including waiting for space
+#define PROF_WRITE_P1 7
+#define PROF_STAGES 8
+
+/* Stage time histogram buckets, bucket i counts times below 2^i ns */
+#define PROF_BUCKETS 32
+
+#ifdef USE_PROFILER
+
+/* Time spent in each stage of the routing loop. Each stage is timed by only
+   one thread, so the counters are plain; report only reads them and can be
+   off by the period being timed. */
+struct profile_stage
+{
+    const char *name;
+    unsigned int hist[PROF_BUCKETS];
+    unsigned int count;
+    long long sum_ns;
+    long long max_ns;
+};
+
+struct profile_stage profile[PROF_STAGES] = {
+    { .name = "poll" },
+    { .name = "read r0" },
+    { .name = "read r1" },
+    { .name = "echo ref" },
+    { .name = "aec" },
+    { .name = "copy" },
+    { .name = "write p0" },
+    { .name = "write p1" },
+};
+
+/* Raw clock is not slewed by ntp, so short intervals are not distorted */
+static long long profile_ns()
+{
+    struct timespec tp;
+    clock_gettime(CLOCK_MONOTONIC_RAW, &tp);
+    return tp.tv_sec * 1000000000LL + tp.tv_nsec;
+}
+
+/* Stage ended now, it started at start_ns */
+static void profile_add(int stage, long long start_ns)
+{
+    struct profile_stage *p = &profile[stage];
+    long long ns = profile_ns() - start_ns;
+    int bucket = 0;
+
+    while (bucket < PROF_BUCKETS - 1 && ns >= (1LL << bucket)) {
+        bucket++;
+    }
+    p->hist[bucket]++;
+    p->count++;
+    p->sum_ns += ns;
+    if (ns > p->max_ns) {
+        p->max_ns = ns;
+    }
+}
+
+/* Upper bound of bucket where given percent of stage times is reached */
+static long long profile_percentile(struct profile_stage *p, int percent)
+{
+    unsigned long long sum = 0;
+    int i;
+
+    for (i = 0; i < PROF_BUCKETS; i++) {
+        sum += p->hist[i];
+        if (sum * 100ULL >= p->count * (unsigned long long) percent) {
+            break;
+        }
+    }
+    return 1LL << i;
+}
+
+/* Log one line per stage that ran, times in us */
+static void profile_report()
+{
+    struct profile_stage *p;
+    int i;
+
+    /* Nothing routed, e.g. the card could not be opened */
+    if (profile[PROF_READ_R1].count == 0) {
+        return;
+    }
+
+    log_msg("profile, period %ld us: stage count avg/p50/p99/max us\n",
+            (long) (r1.period_size * 1000000LL / 8000));
+    for (i = 0; i < PROF_STAGES; i++) {
+        p = &profile[i];
+        if (p->count == 0) {
+            continue;
+        }
+        log_msg("profile %s: %u %lld/%lld/%lld/%lld\n", p->name, p->count,
+                p->sum_ns / p->count / 1000,
+                profile_percentile(p, 50) / 1000,
+                profile_percentile(p, 99) / 1000, p->max_ns / 1000);
+    }
+}
+
+static void profile_reset()
+{
+    int i;
+
+    for (i = 0; i < PROF_STAGES; i++) {
+        memset(profile[i].hist, 0, sizeof(profile[i].hist));
+        profile[i].count = 0;
+        profile[i].sum_ns = 0;
+        profile[i].max_ns = 0;
+    }
+}
+
+/* Set on SIGUSR1, control thread then logs what we have so far */
+volatile sig_atomic_t profile_dump = 0;
+
+static void profile_sighandler(int signum)
+{
+    profile_dump = 1;
+}
+
+/* Called by control thread every CONTROL_POLL_MS */
+static void profile_poll()
+{
+    if (profile_dump) {
+        profile_dump = 0;
+        profile_report();
+    }
+}
+
+/* Time the statement as given stage */
+#define PROFILE(stage, ...) do { \
+        long long profile_start = profile_ns(); \
+        __VA_ARGS__; \
+        profile_add(stage, profile_start); \
+    } while (0)
+
+#else
+
+static void profile_report()
+{
+}
+
+static void profile_reset()
+{
+}
+
+static void profile_poll()
+{
+}
+
+#define PROFILE(stage, ...) do { __VA_ARGS__; } while (0)
+
+#endif
+
+struct voice_processing vp;
+struct voice_processing_config vp_config;
+
+/* Held by main while it (re)creates vp between calls and by control thread
+   while it maintains spare state, routing threads don't take it */
+pthread_mutex_t vp_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Stay resident and route one call after another */
+int daemon_mode = 0;
+
+/* Link and start together capture and playback of each card */
+int link_streams = 0;
+
+/* Keep echo canceller filter converged in previous call */
+int aec_keep = 0;
+
+/* Set once first period from UMTS was routed */
+int routing_started = 0;
+
+/* Set by any of the routing threads when routing should stop (hangup) */
+int routing_done = 0;
+
+/* Control socket, see above. Settings are written by control thread and
+   read by routing threads at the start of each period. */
+struct control
+{
+    const char *path;           // socket path, 0 = no control socket
+    int fd;                     // listening socket or -1
+    int mute[2];                // DIR_UPLINK / DIR_DOWNLINK muted
+    int gain[2];                // gain of direction, Q12
+    int reopen;                 // routing should stop and open streams again
+    int reopening;              // routing stopped because of reopen
+    int endpoint;               // index + 1 of wanted local endpoint, 0 = no change
+    int switching;              // routing stopped to switch local endpoint
+    int running;                // control thread is running
+    int stop;                   // control thread should finish
+    pthread_t thread;
+};
+
+struct control control = {
+    .fd = -1,
+    .gain = { DSP_GAIN_ONE, DSP_GAIN_ONE }
+};
+
+/* Mute or change volume of period which is going to be played */
+static void control_apply(int dir, struct route_stream *s)
+{
+    int gain = __atomic_load_n(&control.gain[dir], __ATOMIC_RELAXED);
+    s16 *buf = (s16 *) s->period_buffer;
+
+    if (__atomic_load_n(&control.mute[dir], __ATOMIC_RELAXED)) {
+        dsp_silence(buf, s->period_size);
+    } else if (gain != DSP_GAIN_ONE) {
+        dsp_gain(buf, s->period_size, gain);
+    }
+}
+
+/* Switch echo suppression backend if control thread has its state ready.
+   Called by the thread doing uplink processing before the period, only
+   pointers are exchanged. */
+static void control_aec()
+{
+    voice_processing_swap(&vp);
+}
+
+/* Returns 1 if routing should stop because streams are to be re-opened or
+   local endpoint switched */
+static int control_reopen()
+{
+    if (__atomic_load_n(&control.endpoint, __ATOMIC_ACQUIRE)) {
+        __atomic_store_n(&control.switching, 1, __ATOMIC_RELEASE);
+        return 1;
+    }
+    if (!__atomic_exchange_n(&control.reopen, 0, __ATOMIC_ACQUIRE)) {
+        return 0;
+    }
+    log_msg("re-opening streams\n");
+    __atomic_store_n(&control.reopening, 1, __ATOMIC_RELEASE);
+    return 1;
+}
+
+static void control_reply(int fd, const char *fmt, ...)
+    __attribute__ ((format(printf, 2, 3)));
+
+static void control_reply(int fd, const char *fmt, ...)
+{
+    char buf[512];
+    va_list ap;
+    int len;
+
+    va_start(ap, fmt);
+    len = vsnprintf(buf, sizeof(buf), fmt, ap);
+    va_end(ap);
+    if (len >= (int)sizeof(buf)) {
+        len = sizeof(buf) - 1;
+    }
+    if (write(fd, buf, len) != len) {
+        return;                 // client went away, nothing to do
+    }
+}
+
+static int control_dir(const char *name)
+{
+    if (strcmp(name, "uplink") == 0) {
+        return DIR_UPLINK;
+    }
+    if (strcmp(name, "downlink") == 0) {
+        return DIR_DOWNLINK;
+    }
+    return -1;
+}
+
+static void control_command(int fd, char *line)
+{
+    const struct voice_processing_backend *backend;
+    char cmd[16];
+    char arg[32];
+    char buf[384];
+    int value;
+    int dir = -1;
+    int n;
+
+    n = sscanf(line, "%15s %31s %d", cmd, arg, &value);
+    if (n <= 0) {
+        return;
+    }
+    if (n >= 2) {
+        dir = control_dir(arg);
+    }
+
+    if (strcmp(cmd, "mute") == 0 && n == 3 && dir >= 0) {
+        __atomic_store_n(&control.mute[dir], value != 0, __ATOMIC_RELAXED);
+        log_msg("control: %s %s\n", arg, value ? "muted" : "unmuted");
+    } else if (strcmp(cmd, "gain") == 0 && n == 3 && dir >= 0 &&
+               value >= 0 && value <= 800) {
+        __atomic_store_n(&control.gain[dir], value * DSP_GAIN_ONE / 100,
+                         __ATOMIC_RELAXED);
+        log_msg("control: %s gain %d%%\n", arg, value);
+    } else if (strcmp(cmd, "aec") == 0 && n == 2) {
+        backend = voice_processing_find(arg);
+        if (backend == 0) {
+            control_reply(fd, "error unknown backend %s\n", arg);
+            return;
+        }
+        /* Also used by next call, main reads it with vp_lock held */
+        pthread_mutex_lock(&vp_lock);
+        vp_config.backend = backend->name;
+        pthread_mutex_unlock(&vp_lock);
+        voice_processing_request(&vp, backend);
+        log_msg("control: echo suppression backend %s\n", backend->name);
+    } else if (strcmp(cmd, "stats") == 0 && n == 1) {
+        if (direction_stats_str(buf, sizeof(buf), &uplink_stats)) {
+            control_reply(fd, "%s\n", buf);
+        }
+        if (direction_stats_str(buf, sizeof(buf), &downlink_stats)) {
+            control_reply(fd, "%s\n", buf);
+        }
+        control_reply(fd, "aec %s, endpoint %s, mute %d/%d, "
+                      "gain %d%%/%d%%, routing %d\n",
+                      vp.backend ? vp.backend->name : "-",
+                      endpoints[endpoint_current].name,
+                      control.mute[DIR_UPLINK], control.mute[DIR_DOWNLINK],
+                      control.gain[DIR_UPLINK] * 100 / DSP_GAIN_ONE,
+                      control.gain[DIR_DOWNLINK] * 100 / DSP_GAIN_ONE,
+                      __atomic_load_n(&routing_started, __ATOMIC_ACQUIRE));
+    } else if (strcmp(cmd, "endpoint") == 0 && n == 2) {
+        value = endpoint_find(arg);
+        if (value < 0) {
+            control_reply(fd, "error unknown endpoint %s\n", arg);
+            return;
+        }
+        __atomic_store_n(&control.endpoint, value + 1, __ATOMIC_RELEASE);
+        log_msg("control: endpoint %s\n", arg);
+    } else if (strcmp(cmd, "reopen") == 0 && n == 1) {
+        __atomic_store_n(&control.reopen, 1, __ATOMIC_RELEASE);
+    } else {
+        control_reply(fd, "error bad command\n");
+        return;
+    }
+    control_reply(fd, "ok\n");
+}
+
+/* Serve one client at a time, newer connection replaces the older one */
+static void *control_thread(void *arg)
+{
+    struct pollfd pfd[2];
+    char line[CONTROL_LINE];
+    int client = -1;
+    int len = 0;
+    char *nl;
+    int n;
+
+    while (!__atomic_load_n(&control.stop, __ATOMIC_ACQUIRE)) {
+        pfd[0].fd = control.fd;
+        pfd[0].events = POLLIN;
+        pfd[1].fd = client;
+        pfd[1].events = POLLIN;
+        n = poll(pfd, 2, CONTROL_POLL_MS);
+
+        profile_poll();
+        pthread_mutex_lock(&vp_lock);
+        voice_processing_maintain(&vp);
+        pthread_mutex_unlock(&vp_lock);
+        if (n <= 0) {
+            continue;
+        }
+
+        if (pfd[0].revents & POLLIN) {
+            n = accept4(control.fd, 0, 0, SOCK_CLOEXEC);
+            if (n >= 0) {
+                if (client >= 0) {
+                    close(client);
+                }
+                client = n;
+                len = 0;
+                continue;
+            }
+        }
+        if (client < 0 || pfd[1].revents == 0) {
+            continue;
+        }
+
+        n = read(client, line + len, sizeof(line) - 1 - len);
+        if (n <= 0) {
+            close(client);
+            client = -1;
+            continue;
+        }
+        len += n;
+        while ((nl = memchr(line, '\n', len)) != 0) {
+            *nl = 0;
+            control_command(client, line);
+            len -= nl + 1 - line;
+            memmove(line, nl + 1, len);
+        }
+        if (len == sizeof(line) - 1) {
+            control_reply(client, "error line too long\n");
+            len = 0;
+        }
+    }
+    if (client >= 0) {
+        close(client);
+    }
+    return 0;
+}
+
+/* Create the socket if path is given */
+static void control_listen(const char *path)
+{
+    struct sockaddr_un addr;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        log_msg("control socket path too long\n");
+        return;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    control.fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (control.fd < 0) {
+        log_msg("control socket failed: %s\n", strerror(errno));
+        return;
+    }
+    unlink(path);
+    if (bind(control.fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        listen(control.fd, 1) < 0) {
+        log_msg("control socket %s failed: %s\n", path, strerror(errno));
+        close(control.fd);
+        control.fd = -1;
+        return;
+    }
+    control.path = path;
+    log_msg("control socket %s\n", path);
+}
+
+/* Start control thread, with socket if path is not 0, before the process
+   gets realtime priority. Without socket it only maintains vp. */
+static void control_start(const char *path)
+{
+    if (path) {
+        control_listen(path);
+    }
+    if (helper_thread_create(&control.thread, control_thread)) {
+        log_msg("failed to create control thread\n");
+        return;
+    }
+    __atomic_store_n(&control.running, 1, __ATOMIC_RELEASE);
+}
+
+static void control_stop()
+{
+    if (__atomic_load_n(&control.running, __ATOMIC_ACQUIRE)) {
+        __atomic_store_n(&control.stop, 1, __ATOMIC_RELEASE);
+        pthread_join(control.thread, 0);
+        control.running = 0;
+    }
+    if (control.fd >= 0) {
+        close(control.fd);
+        control.fd = -1;
+        unlink(control.path);
+    }
+}
+
+/* Report the call and close the streams, buffers are kept for next call */
+static void end_call()
+{
+    stats_report(&uplink_stats);
+    stats_report(&downlink_stats);
+    profile_report();
+    if (vp.vad_frames) {
+        log_msg("echo canceller bypassed for %u of %u frames, far end "
+                "silent\n", vp.vad_bypassed, vp.vad_frames);
+    }
+
+    close_route_stream(&p0);
+    close_route_stream(&p1);
+    close_route_stream(&r0);
+    close_route_stream(&r1);
+    record_end(&p1, &p0);
+    
+    set_aux_leds(0, 0);
+}
+
+/* Stop helper threads, so the log is written out and the control socket
+   removed, also when main fails before the first call */
+static void cleanup()
+{
+    end_call();
+    call_watch_close(&call_watch);
+    control_stop();
+    record_stop();
+    led_stop();
+
+    log_stop();
+    fclose(logfile);
+}
+
+/* Only the flag is async-signal-safe here. It's installed without
+   SA_RESTART, so blocking reads, writes and polls return EINTR right away
+   and the loops see the flag; main() then closes the streams and stops the
+   helper threads. */
+static void sighandler(int signum)
+{
+    terminating = signum;
+}
+
+/* Capture s got ahead of the other one, which paces single thread loop.
+   Its period just read is dropped and replaced by the next one. */
+static int capture_drop(struct route_stream *s, struct route_stream *other)
+{
+    log_msg("%s: %ld frames ahead of %s, period dropped\n", s->id,
+            (long) (s->delay - other->delay), other->id);
+    return route_stream_read(s);
+}
+
+static void route_single_thread()
+{
+    snd_pcm_sframes_t ahead;
+    int rc0;
+    int rc1;
+    long long start_us;
+
+    while (!terminating) {
+
+        /* Recording  - first from internal card (so that we always clean the
+           recording buffer), then UMTS, which can fail. Failed period can be
+           concealed only with jitter buffer. */
+        PROFILE(PROF_READ_R0, rc0 = route_stream_read(&r0));
+        if (rc0) {
+            blink_aux();
+            if (!p1.jitter) {
+                continue;
+            }
+        }
+
+        PROFILE(PROF_READ_R1, rc1 = route_stream_read(&r1));
+        if (rc1 == ERR_READ && routing_started) {
+            log_msg("read error after some succesful routing (hangup)\n");
+            break;
+        }
+        if (routing_started && call_watch_hangup(&call_watch, &r1)) {
+            break;
+        }
+        if (control_reopen()) {
+            break;
+        }
+        if (rc1 != 0 && !p0.jitter) {
+            continue;
+        }
+
+        /* Playback drift compensation can't help captures here */
+        if (drift_comp && routing_started && rc0 == 0 && rc1 == 0) {
+            ahead = DRIFT_CAPTURE_AHEAD * (snd_pcm_sframes_t) r0.period_size;
+            if (r0.delay - r1.delay >= ahead) {
+                rc0 = capture_drop(&r0, &r1);
+            } else if (r1.delay - r0.delay >= ahead) {
+                rc1 = capture_drop(&r1, &r0);
+            }
+        }
+
+        if (rc1 == 0) {
+            if (routing_started) {
+                show_progress();
+            } else {
+                log_msg("voice routing started\n");
+                routing_started = 1;
+            }
+        }
+        if (!routing_started) {
+            if (rc0 == 0) {
+                route_stream_keep_primed(&p0);
+            }
+            continue;
+        }
+
+        if (rc0 == 0) {
+            start_us = now_us();
+            control_aec();
+            route_stream_begin(&p1);
+
+            /* Duplex backend processes both directions together below */
+            if (vp.backend->duplex) {
+                PROFILE(PROF_COPY, memmove(p1.period_buffer, r0.period_buffer,
+                                           r0.period_buffer_size));
+            } else {
+                PROFILE(PROF_ECHO_REF,
+                        echo_history_read(&echo_history,
+                                          echo_history.reference,
+                                          r0.period_size, r0.delay));
+                PROFILE(PROF_AEC,
+                        show_echo_state(voice_processing_uplink(&vp,
+                                                (s16 *) r0.period_buffer,
+                                                echo_history.reference,
+                                                (s16 *) p1.period_buffer)));
+            }
+            stats_add_time(&uplink_stats, start_us);
+        }
+
+        if (rc1 == 0) {
+            start_us = now_us();
+            route_stream_begin(&p0);
+            PROFILE(PROF_COPY, memmove(p0.period_buffer, r1.period_buffer,
+                                       r1.period_buffer_size));
+            voice_processing_downlink(&vp, (s16 *) p0.period_buffer);
+            stats_add_time(&downlink_stats, start_us);
+        }
+
+        if (rc0 == 0 && rc1 == 0 && vp.backend->duplex) {
+            start_us = now_us();
+            PROFILE(PROF_AEC,
+                    show_echo_state(voice_processing_duplex(&vp,
+                                                    (s16 *) p0.period_buffer,
+                                                    (s16 *) p1.period_buffer)));
+            stats_add_time(&uplink_stats, start_us);
+        }
+
+        if (rc1 == 0) {
+            control_apply(DIR_DOWNLINK, &p0);
+        }
+        if (rc0 == 0) {
+            control_apply(DIR_UPLINK, &p1);
+        }
+        PROFILE(PROF_WRITE_P0, route_stream_deliver(&p0, rc1 == 0));
+        PROFILE(PROF_WRITE_P1, route_stream_deliver(&p1, rc0 == 0));
+
+        if (rc0 == 0) {
+            stats_period_done(&uplink_stats);
+        }
+        if (rc1 == 0) {
+            stats_period_done(&downlink_stats);
+        }
+    }
+}
+
+/* Uplink: r0 -> echo cancellation -> p1 */
+static void *uplink_thread(void *arg)
+{
+    s16 *echo_ref = echo_history.reference;
+    long long start_us;
+    int rc;
+
+    make_realtime("uplink");
+
+    while (!terminating && !__atomic_load_n(&routing_done, __ATOMIC_ACQUIRE)) {
+
+        /* Always read, so that we keep the recording buffer clean */
+        PROFILE(PROF_READ_R0, rc = route_stream_read(&r0));
+
+        /* Nothing to send until sound is available from UMTS */
+        if (!__atomic_load_n(&routing_started, __ATOMIC_ACQUIRE)) {
+            continue;
+        }
+
+        /* Lost period can be concealed by jitter buffer */
+        if (rc != 0) {
+            PROFILE(PROF_WRITE_P1, route_stream_deliver(&p1, 0));
+            continue;
+        }
+
+        start_us = now_us();
+        control_aec();
+
+        /* Downlink thread records what it plays, we only look back */
+        PROFILE(PROF_ECHO_REF, echo_history_read(&echo_history, echo_ref,
+                                                 r0.period_size, r0.delay));
+
+        route_stream_begin(&p1);
+
+        /* With walkie backend only the uplink volume is adjusted here, the
+           echo reference is just a copy of what downlink thread already
+           played */
+        PROFILE(PROF_AEC,
+                show_echo_state(voice_processing_uplink(&vp,
+                                                (s16 *) r0.period_buffer,
+                                                echo_ref,
+                                                (s16 *) p1.period_buffer)));
+        control_apply(DIR_UPLINK, &p1);
+        stats_add_time(&uplink_stats, start_us);
+
+        PROFILE(PROF_WRITE_P1, route_stream_deliver(&p1, 1));
+        stats_period_done(&uplink_stats);
+    }
+
+    return 0;
+}
+
+/* Downlink: r1 -> p0 */
+static void *downlink_thread(void *arg)
+{
+    long long start_us;
+    int rc;
+
+    make_realtime("downlink");
+
+    while (!terminating && !__atomic_load_n(&routing_done, __ATOMIC_ACQUIRE)) {
+
+        PROFILE(PROF_READ_R1, rc = route_stream_read(&r1));
+        if (rc == ERR_READ && routing_started) {
+            log_msg("read error after some succesful routing (hangup)\n");
+            break;
+        }
+        if (routing_started && call_watch_hangup(&call_watch, &r1)) {
+            break;
+        }
+        if (control_reopen()) {
+            break;
+        }
+        if (rc == 0) {
+            if (routing_started) {
+                show_progress();
+            } else {
+                log_msg("voice routing started\n");
+                __atomic_store_n(&routing_started, 1, __ATOMIC_RELEASE);
+            }
+            start_us = now_us();
+            route_stream_begin(&p0);
+            PROFILE(PROF_COPY, memmove(p0.period_buffer, r1.period_buffer,
+                                       r1.period_buffer_size));
+            voice_processing_downlink(&vp, (s16 *) p0.period_buffer);
+            control_apply(DIR_DOWNLINK, &p0);
+            stats_add_time(&downlink_stats, start_us);
+        }
+        if (!routing_started) {
+            continue;
+        }
+
+        PROFILE(PROF_WRITE_P0, route_stream_deliver(&p0, rc == 0));
+        if (rc == 0) {
+            stats_period_done(&downlink_stats);
+        }
+    }
+
+    __atomic_store_n(&routing_done, 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+/* Process directed signal can be delivered to main waiting here, which
+   does not interrupt the routing thread blocked in read on silent modem. So
+   while terminating, the signal is passed on to the thread until it's
+   done. */
+static void join_routing_thread(pthread_t thread)
+{
+    struct timespec deadline;
+
+    for (;;) {
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += THREAD_JOIN_MS * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        if (pthread_timedjoin_np(thread, 0, &deadline) == 0) {
+            return;
+        }
+        if (terminating) {
+            pthread_kill(thread, terminating);
+        }
+    }
+}
+
+static void route_threads()
+{
+    pthread_t uplink;
+    pthread_t downlink;
+    pthread_attr_t attr;
+
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, RT_THREAD_STACK);
+
+    if (pthread_create(&uplink, &attr, uplink_thread, 0)) {
+        log_msg("failed to create uplink thread\n");
+        pthread_attr_destroy(&attr);
+        return;
+    }
+    if (pthread_create(&downlink, &attr, downlink_thread, 0)) {
+        log_msg("failed to create downlink thread\n");
+        __atomic_store_n(&routing_done, 1, __ATOMIC_RELEASE);
+    } else {
+        join_routing_thread(downlink);
+    }
+    join_routing_thread(uplink);
+
+    pthread_attr_destroy(&attr);
+}
+
+/* Returns 1 if poll() reported any event for the stream */
+static int poll_ready(struct route_stream *s, struct pollfd *pfds, int count)
+{
+    unsigned short revents = 0;
+    if (snd_pcm_poll_descriptors_revents(s->handle, pfds, count, &revents) < 0) {
+        return 0;
+    }
+    return revents != 0;
+}
+
+/* Period was processed into period_buffer, queue it for poll_write() */
+static void poll_queue(struct route_stream *s)
+{
+    if (s->jitter) {
+        jitter_push(s->jitter, s->period_buffer);
+        s->due++;
+    } else if (s->drift) {
+        route_stream_queue(s);
+    } else {
+        /* Newer period replaces the one waiting to be played */
+        s->hw_ready = 0;
+    }
+    s->pending = 1;
+}
+
+/* Period of the capture feeding s was lost, jitter buffer conceals it */
+static void poll_missed(struct route_stream *s)
+{
+    if (s->jitter) {
+        s->due++;
+        s->pending = 1;
+    }
+}
+
+/* Try to play pending period, it stays pending if there is no space yet.
+   With jitter buffer one period (or concealment) is pulled per period read
+   from the capture feeding the stream, like in the other modes, so the
+   playback buffer is not filled ahead. */
+static void poll_write(struct route_stream *s)
+{
+    snd_pcm_sframes_t avail;
+
+    if (!s->pending) {
+        return;
+    }
+    if (s->jitter) {
+        while (s->due > 0 &&
+               (s->drift == 0 || s->drift->fifo_frames < s->period_size)) {
+            avail = snd_pcm_avail_update(s->handle);
+            if (avail >= 0 && avail < (snd_pcm_sframes_t) s->hw_period_size) {
+                break;
+            }
+            s->due--;
+            if (!jitter_pull(s->jitter, s->period_buffer)) {
+                continue;
+            }
+            if (s->drift) {
+                route_stream_queue(s);
+            } else {
+                route_stream_write(s);
+            }
+        }
+        if (s->drift) {
+            route_stream_flush(s);
+        }
+        s->pending = s->due > 0 ||
+            (s->drift && s->drift->fifo_frames >= s->period_size);
+        return;
+    }
+    if (s->drift) {
+        route_stream_flush(s);
+        s->pending = s->drift->fifo_frames >= s->period_size;
+    } else if (route_stream_write(s) != ERR_AGAIN) {
+        s->pending = 0;
+    }
+}
 
-static void vol_up(char *buf, snd_pcm_uframes_t period_size)
+static void route_poll()
 {
-    int i;
-    s16 *val = (s16 *) (buf);
-    for (i = 0; i < period_size; i++) {
-        *val = *val * 2;
-        val++;
+    struct route_stream *streams[4] = { &r0, &r1, &p0, &p1 };
+    struct pollfd fds[MAX_POLL_FDS];
+    struct pollfd active[MAX_POLL_FDS];
+    int first[4];
+    int count[4];
+    int nfds = 0;
+    int watch = -1;
+    int timeout;
+    int timed_out;
+    long long start_us;
+    int i, j, rc;
+    s16 *echo_ref = echo_history.reference;
+
+    p0.pending = p1.pending = 0;
+    p0.due = p1.due = 0;
+
+    for (i = 0; i < 4; i++) {
+        count[i] = snd_pcm_poll_descriptors_count(streams[i]->handle);
+        if (count[i] <= 0 || nfds + count[i] > MAX_POLL_FDS) {
+            err("bad poll descriptors count", count[i], streams[i], 0);
+            return;
+        }
+        first[i] = nfds;
+        snd_pcm_poll_descriptors(streams[i]->handle, fds + nfds, count[i]);
+        nfds += count[i];
+    }
+
+    /* Wake up on hangup too */
+    if (call_watch.fd >= 0 && nfds < MAX_POLL_FDS) {
+        watch = nfds++;
+        fds[watch].fd = call_watch.fd;
+        fds[watch].events = POLLIN;
+    }
+
+    /* Non-blocking capture would never be started by reading */
+    snd_pcm_start(r0.handle);
+    snd_pcm_start(r1.handle);
+
+    /* If umts is silent for 10 periods, check if it's still there */
+    timeout = 10 * 1000 * r1.period_size / 8000;
+
+    while (!terminating) {
+
+        /* Wait for playback only if we have something to play, otherwise it
+           would wake us all the time */
+        memcpy(active, fds, nfds * sizeof(struct pollfd));
+        for (i = 0; i < 4; i++) {
+            if (streams[i]->stream == SND_PCM_STREAM_PLAYBACK &&
+                !streams[i]->pending) {
+                for (j = 0; j < count[i]; j++) {
+                    active[first[i] + j].fd = -1;
+                }
+            }
+        }
+
+        PROFILE(PROF_POLL, rc = poll(active, nfds, timeout));
+        if (rc < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            log_msg("poll failed: %s\n", strerror(errno));
+            break;
+        }
+        if (routing_started && (watch < 0 || active[watch].revents) &&
+            call_watch_hangup(&call_watch, &r1)) {
+            break;
+        }
+        if (control_reopen()) {
+            break;
+        }
+
+        /* Downlink. Nothing to read after spurious wakeup is not a lost
+           period, but timeout is. */
+        if (rc == 0 || poll_ready(&r1, active + first[1], count[1])) {
+            timed_out = rc == 0;
+            PROFILE(PROF_READ_R1, rc = route_stream_read(&r1));
+            if (rc == ERR_READ && routing_started) {
+                log_msg("read error after some succesful routing (hangup)\n");
+                break;
+            }
+            if (rc == 0) {
+                if (routing_started) {
+                    show_progress();
+                } else {
+                    log_msg("voice routing started\n");
+                    routing_started = 1;
+                }
+                start_us = now_us();
+                route_stream_begin(&p0);
+                PROFILE(PROF_COPY, memmove(p0.period_buffer, r1.period_buffer,
+                                           r1.period_buffer_size));
+                voice_processing_downlink(&vp, (s16 *) p0.period_buffer);
+                control_apply(DIR_DOWNLINK, &p0);
+                poll_queue(&p0);
+                stats_add_time(&downlink_stats, start_us);
+                stats_period_done(&downlink_stats);
+            } else if (routing_started && (rc != ERR_AGAIN || timed_out)) {
+                poll_missed(&p0);
+            }
+        }
+
+        /* Uplink, but only after sound is available from UMTS */
+        rc = ERR_AGAIN;
+        if (poll_ready(&r0, active + first[0], count[0])) {
+            PROFILE(PROF_READ_R0, rc = route_stream_read(&r0));
+        }
+        if (rc == 0 && !routing_started) {
+            route_stream_keep_primed(&p0);
+        }
+        if (rc != 0 && rc != ERR_AGAIN && routing_started) {
+            poll_missed(&p1);
+        }
+        if (rc == 0 && routing_started) {
+            start_us = now_us();
+            control_aec();
+            PROFILE(PROF_ECHO_REF, echo_history_read(&echo_history, echo_ref,
+                                                     r0.period_size,
+                                                     r0.delay));
+            route_stream_begin(&p1);
+
+            /* Like in threaded mode, only uplink volume is adjusted */
+            PROFILE(PROF_AEC,
+                    show_echo_state(voice_processing_uplink(&vp,
+                                                (s16 *) r0.period_buffer,
+                                                echo_ref,
+                                                (s16 *) p1.period_buffer)));
+            control_apply(DIR_UPLINK, &p1);
+            poll_queue(&p1);
+            stats_add_time(&uplink_stats, start_us);
+            stats_period_done(&uplink_stats);
+        }
+
+        PROFILE(PROF_WRITE_P0, poll_write(&p0));
+        PROFILE(PROF_WRITE_P1, poll_write(&p1));
     }
 }
 
-static void vol_down(char *buf, snd_pcm_uframes_t period_size)
+/* Latency test, see above. Chirp and the capture window are only used by
+   the test, so they are static instead of taken from arena. */
+s16 latency_chirp[LATENCY_CHIRP_FRAMES];
+s16 latency_window[LATENCY_WINDOW_FRAMES];
+long long latency_read_us[LATENCY_WINDOW_FRAMES];     // per captured period
+snd_pcm_sframes_t latency_read_delay[LATENCY_WINDOW_FRAMES];
+
+/* Linear sweep LATENCY_CHIRP_FROM..LATENCY_CHIRP_TO Hz with faded ends, its
+   autocorrelation has one sharp peak */
+static void latency_chirp_init()
 {
+    double duration = LATENCY_CHIRP_FRAMES / 8000.0;
+    double rate = (LATENCY_CHIRP_TO - LATENCY_CHIRP_FROM) / duration;
+    double t, fade;
     int i;
-    s16 *val = (s16 *) (buf);
-    for (i = 0; i < period_size; i++) {
-        *val = 0;               // *val / 2;
-        val++;
+
+    for (i = 0; i < LATENCY_CHIRP_FRAMES; i++) {
+        t = i / 8000.0;
+        fade = 1.0;
+        if (i < LATENCY_CHIRP_FRAMES / 8) {
+            fade = i * 8.0 / LATENCY_CHIRP_FRAMES;
+        } else if (i > LATENCY_CHIRP_FRAMES * 7 / 8) {
+            fade = (LATENCY_CHIRP_FRAMES - i) * 8.0 / LATENCY_CHIRP_FRAMES;
+        }
+        latency_chirp[i] = LATENCY_CHIRP_LEVEL * fade *
+            sin(2 * M_PI * (LATENCY_CHIRP_FROM * t + rate * t * t / 2));
     }
 }
 
-/* Reduce echo by adjusting volumes in record and playback buffer with simple
-   walkie-talkie like algorithm.
+/* Position of the chirp in captured window or -1 if normalized correlation
+   peak is under LATENCY_MIN_PEAK (percent) */
+static int latency_find(int frames, int *peak)
+{
+    double chirp_energy = dsp_energy(latency_chirp, LATENCY_CHIRP_FRAMES);
+    double energy = dsp_energy(latency_window, LATENCY_CHIRP_FRAMES);
+    double best = 0;
+    double score;
+    long long dot;
+    int best_pos = -1;
+    int pos, i;
 
-   First we decide which buffer has higher volume (i.e. if you are speaking or
-   listening). This buffer is kept as is and we made the other buffer silent or
-   very low volume.
-   
-   We use integer for computing volumes, this should be fine if the buffer size
-   is not too big (65535 is max).
-*/
-static void reduce_echo(char *p0, char *p1, snd_pcm_uframes_t period_size)
+    for (pos = 0; pos + LATENCY_CHIRP_FRAMES <= frames; pos++) {
+        if (pos > 0) {
+            energy += (double) latency_window[pos + LATENCY_CHIRP_FRAMES - 1] *
+                latency_window[pos + LATENCY_CHIRP_FRAMES - 1] -
+                (double) latency_window[pos - 1] * latency_window[pos - 1];
+        }
+        if (energy <= 0) {
+            continue;
+        }
+        dot = 0;
+        for (i = 0; i < LATENCY_CHIRP_FRAMES; i++) {
+            dot += latency_window[pos + i] * latency_chirp[i];
+        }
+        score = dot / sqrt(energy * chirp_energy);
+        if (score > best) {
+            best = score;
+            best_pos = pos;
+        }
+    }
+    *peak = best * 100;
+    return *peak >= LATENCY_MIN_PEAK ? best_pos : -1;
+}
+
+/* Play chirp on p and find it in what c records, latency_trials times.
+   Returns 0 if all trials found the chirp. */
+static int latency_test(struct route_stream *p, struct route_stream *c)
 {
-    int i;
-    int sum_p0 = 0;
-    int sum_p1 = 0;
-    s16 *v0;
-    s16 *v1;
-
-    v0 = (s16 *) (p0);
-    v1 = (s16 *) (p1);
-    for (i = 0; i < period_size; i++) {
-        sum_p0 += abs(*v0);
-        sum_p1 += abs(*v1);
-        v0++;
-        v1++;
-    }
-
-    int diff = sum_p0 - sum_p1;
-
-    /* 10000 seems to be good limit value. Silence is ~2000 and speech is
-       ~80000. It would be nice to somehow compute this value on the fly, but
-       i have no idea how to do it now */
-    if (diff > 10000) {
-        /* fprintf(stderr, "listening p0=%*d    p1=%*d    diff=%*d\n", -6, sum_p0,
-           -6, sum_p1, -6, diff); */
-        vol_up(p0, period_size);
-        vol_down(p1, period_size);
-        set_aux_leds(0, 1);
-        return;
+    double total_sum = 0, total_sq = 0, total_min = 0, total_max = 0;
+    double play_sum = 0, path_sum = 0, capture_sum = 0;
+    double play, path, capture, total, variance;
+    long long write_us = 0;
+    snd_pcm_sframes_t write_delay = 0;
+    int window_periods;
+    int gap_periods;
+    int chirp_periods;
+    int trial, found = 0;
+    int n, pos, peak, k;
+    int rc;
 
-    } else if (diff < -10000) {
-        /* fprintf(stderr, "talking   p0=%*d    p1=%*d    diff=%*d\n", -6, sum_p0,
-           -6, sum_p1, -6, diff); */
-        vol_up(p1, period_size);
-        vol_down(p0, period_size);
-        set_aux_leds(1, 0);
-    } else {
-        set_aux_leds(0, 0);
+    p->mmap = c->mmap = 0;
+    set_geometry(p, period_size, buffer_size);
+    open_route_stream_repeated(p);
+    set_geometry(c, p->period_size, p->buffer_size);
+    open_route_stream_repeated(c);
+    if (terminating) {
+        return 1;
+    }
+    if (c->period_size != p->period_size) {
+        log_msg("cards negotiated different period sizes\n");
+        return 1;
+    }
+
+    latency_chirp_init();
+    window_periods = LATENCY_WINDOW_FRAMES / c->period_size;
+    chirp_periods = (LATENCY_CHIRP_FRAMES + p->period_size - 1) /
+        p->period_size;
+    gap_periods = LATENCY_GAP_MS * 8 / p->period_size + 1;
+    log_msg("latency test %s -> %s, %d trials, period %lu buffer %lu\n",
+            p->id, c->id, latency_trials, (unsigned long)p->period_size,
+            (unsigned long)p->buffer_size);
+
+    for (trial = 1; trial <= latency_trials && !terminating; trial++) {
+        /* Silence, then chirp recorded into window from the period it was
+           written. Capture is read before each write, so both keep pace. */
+        for (n = -gap_periods; n < window_periods; n++) {
+            rc = route_stream_read(c);
+            if (rc && n >= 0) {
+                break;
+            }
+            if (n >= 0) {
+                memcpy(latency_window + n * c->period_size, c->period_buffer,
+                       c->period_buffer_size);
+                latency_read_us[n] = now_us();
+                latency_read_delay[n] = c->delay;
+            }
+
+            /* Period n + 1 of the chirp, the first one at n == -1 */
+            dsp_silence((s16 *) p->period_buffer, p->period_size);
+            k = (n + 1) * p->period_size;
+            if (n + 1 >= 0 && n + 1 < chirp_periods) {
+                memcpy(p->period_buffer, latency_chirp + k,
+                       (k + p->period_size > LATENCY_CHIRP_FRAMES ?
+                        LATENCY_CHIRP_FRAMES - k : p->period_size) *
+                       sizeof(s16));
+            }
+            route_stream_write(p);
+            if (n == -1) {
+                write_us = now_us();
+                write_delay = p->delay;
+            }
+        }
+        if (n < window_periods) {
+            log_msg("latency trial %d: capture failed\n", trial);
+            continue;
+        }
+
+        pos = latency_find(n * c->period_size, &peak);
+        if (pos < 0) {
+            log_msg("latency trial %d: chirp not found (peak %d%%)\n", trial,
+                    peak);
+            continue;
+        }
+
+        /* Chirp's first frame left for the speaker (delay minus the period
+           just written) and was captured (its place in the period read plus
+           what was still queued in capture buffer), so the three add up to
+           the time from writing it until it was read back */
+        k = pos / c->period_size;
+        play = (write_delay - (double) p->period_size) / 8;
+        capture = (latency_read_delay[k] + c->period_size - 1 -
+                   pos % c->period_size) / 8.0;
+        path = (latency_read_us[k] - write_us) / 1000.0 - capture - play;
+        total = play + path + capture;
+        log_msg("latency trial %d: %.1f ms = playback %.1f + path %.1f + "
+                "capture %.1f, peak %d%%\n", trial, total, play, path,
+                capture, peak);
+
+        if (found == 0 || total < total_min) {
+            total_min = total;
+        }
+        if (found == 0 || total > total_max) {
+            total_max = total;
+        }
+        total_sum += total;
+        total_sq += total * total;
+        play_sum += play;
+        path_sum += path;
+        capture_sum += capture;
+        found++;
+    }
+
+    if (found == 0) {
+        log_msg("latency %s -> %s: chirp not found in any trial\n", p->id,
+                c->id);
+        return 1;
+    }
+
+    /* Rounding can make it slightly negative when all trials are equal */
+    variance = total_sq / found - (total_sum / found) * (total_sum / found);
+    if (variance < 0) {
+        variance = 0;
     }
-    //printf("%d, %d, %d\n", round++, sum_a, sum_b);
+    log_msg("latency %s -> %s over %d trials: %.1f ms (min %.1f max %.1f "
+            "jitter %.1f), playback %.1f, path %.1f, capture %.1f\n",
+            p->id, c->id, found, total_sum / found, total_min, total_max,
+            sqrt(variance), play_sum / found, path_sum / found,
+            capture_sum / found);
+    return found == latency_trials ? 0 : 1;
 }
-#endif
 
-struct route_stream p0 = {
-    .id = "p0",
-    .pcm_name = "default",
-    .stream = SND_PCM_STREAM_PLAYBACK,
-    .start_threshold = 1024,
-    .stop_threshold = 1024,
-    .buffer_size = 1024,
-    .period_size = 256,
-    .handle = 0,
-    .period_buffer = 0
-};
+/* Everything we take from arena for configured geometry. Cards can
+   negotiate bigger period or buffer, so it's twice that. */
+static size_t arena_size()
+{
+    size_t period = period_size * sizeof(s16);
+    size_t history = sizeof(s16);
+    size_t size;
 
-struct route_stream r0 = {
-    .id = "r0",
-    .pcm_name = "default",
-    .stream = SND_PCM_STREAM_CAPTURE,
-    .start_threshold = 0,
-    .stop_threshold = 0,
-    .buffer_size = 1024,
-    .period_size = 256,
-    .handle = 0,
-    .period_buffer = 0
-};
+    while (history < 4 * buffer_size * sizeof(s16)) {
+        history <<= 1;
+    }
 
-struct route_stream p1 = {
-    .id = "p1",
-    .pcm_name = "hw:1,0",
-    .stream = SND_PCM_STREAM_PLAYBACK,
-    .start_threshold = 1024,
-    .stop_threshold = 1024,
-    .buffer_size = 1024,
-    .period_size = 256,
-    .handle = 0,
-    .period_buffer = 0
-};
+    size = 4 * ARENA_BLOCK(period);       // period buffers
+    size += ARENA_BLOCK(history) + ARENA_BLOCK(period);
+    if (jitter_target_ms >= 0) {
+        size += 2 * ARENA_BLOCK((jitter_max(period_size, jitter_target_ms,
+                                            jitter_max_ms) + 1) * period);
+        size += 2 * ARENA_BLOCK(period);
+    }
+    if (drift_comp) {
+        size += 2 * ARENA_BLOCK(4 * period);
+    }
+    size += route_stream_memory(&p0, period_size);
+    size += route_stream_memory(&r0, period_size);
+    size += route_stream_memory(&p1, period_size);
+    size += route_stream_memory(&r1, period_size);
+    size += record_memory();
+    size += voice_processing_memory(period_size, &vp_config);
+    return 2 * size;
+}
 
-struct route_stream r1 = {
-    .id = "r1",
-    .pcm_name = "hw:1,0",
-    .stream = SND_PCM_STREAM_CAPTURE,
-    .start_threshold = 0,
-    .stop_threshold = 0,
-    .buffer_size = 1024,
-    .period_size = 256,
-    .handle = 0,
-    .period_buffer = 0
-};
+/* Open r0 and p0 on given endpoint with geometry umts negotiated */
+static int open_endpoint(int i)
+{
+    r0.pcm_name = p0.pcm_name = endpoints[i].pcm_name;
+    set_geometry(&p0, p1.period_size, p1.buffer_size);
+    set_geometry(&r0, p1.period_size, p1.buffer_size);
+    if (open_route_stream(&p0) || open_route_stream(&r0) ||
+        p0.period_size != p1.period_size || r0.period_size != p1.period_size) {
+        close_route_stream(&p0);
+        close_route_stream(&r0);
+        return -1;
+    }
+    endpoint_current = i;
+    log_msg("local endpoint %s (%s)\n", endpoints[i].name,
+            endpoints[i].pcm_name);
+    return 0;
+}
 
-static void cleanup()
+/* Routing stopped for control socket endpoint switch: close r0 and p0 and
+   open them on the wanted endpoint, umts streams stay open. If it can't be
+   opened, we go back to the previous one. Returns 1 if routing should
+   continue. */
+static int switch_endpoint()
 {
+    int previous = endpoint_current;
+    int wanted;
+
+    if (!control.switching) {
+        return 0;
+    }
+    control.switching = 0;
+    wanted = __atomic_exchange_n(&control.endpoint, 0, __ATOMIC_ACQUIRE) - 1;
+    if (terminating || wanted < 0 || wanted == previous) {
+        return !terminating;
+    }
+
     close_route_stream(&p0);
-    close_route_stream(&p1);
     close_route_stream(&r0);
-    close_route_stream(&r1);
-    
-    set_aux_leds(0, 0);
-    fclose(logfile);
+    if (open_endpoint(wanted)) {
+        log_msg("failed to open endpoint %s, back to %s\n",
+                endpoints[wanted].name, endpoints[previous].name);
+        if (open_endpoint(previous)) {
+            log_msg("no local endpoint, ending the call\n");
+            return 0;
+        }
+    }
+
+    /* Acoustic path and playback level are different now */
+    voice_processing_reset(&vp, 0);
+    if (p0.drift) {
+        drift_init(&p0_drift, &p0, drift_target);
+    }
+    if (link_streams && mode != MODE_THREADS) {
+        route_stream_link(&r0, &p0);
+    }
+    return 1;
 }
 
-static void sighandler(int signum)
+/* Daemon mode, call could not be routed. Retrying it right away would fail
+   the same way, so we wait until modem device node is removed (hangup) or
+   CALL_WAIT_MS if we can't see that. */
+static void wait_call_end()
 {
-    if (terminating) {
+    struct timespec ts = { CALL_WAIT_MS / 1000,
+                           (CALL_WAIT_MS % 1000) * 1000000L };
+
+    if (call_watch.fd < 0 || call_watch.node_prefix[0] == 0) {
+        nanosleep(&ts, 0);
         return;
     }
-    terminating = 1;
-    fprintf(logfile, "gsm-voice-routing ending - signal %d\n", signum);
-    cleanup();
-    exit(0);
+    while (!terminating && !call_watch.hangup) {
+        call_watch_wait(&call_watch, CALL_WAIT_MS);
+    }
+}
+
+/* Open the streams, route one call and close the streams again. Returns 0
+   when the call ended by hangup, 1 if it could not be routed at all and 2
+   if streams should be opened again (control socket reopen). */
+static int route_call()
+{
+    int wanted;
+
+    /* Nothing routed yet in this call */
+    routing_started = 0;
+    routing_done = 0;
+    control.reopening = 0;
+    control.switching = 0;
+    call_watch_events(&call_watch);
+    call_watch.hangup = 0;
+    stats_reset(&uplink_stats);
+    stats_reset(&downlink_stats);
+    profile_reset();
+
+    /* Open streams - umts first, the rest follows geometry it negotiated */
+    set_geometry(&p1, period_size, buffer_size);
+    open_route_stream_repeated(&p1);
+    set_geometry(&r1, p1.period_size, p1.buffer_size);
+    open_route_stream_repeated(&r1);
+
+    /* Endpoint switched between calls */
+    wanted = __atomic_exchange_n(&control.endpoint, 0, __ATOMIC_ACQUIRE);
+    if (wanted) {
+        endpoint_current = wanted - 1;
+    }
+    r0.pcm_name = p0.pcm_name = endpoints[endpoint_current].pcm_name;
+    set_geometry(&p0, p1.period_size, p1.buffer_size);
+    open_route_stream_repeated(&p0);
+    set_geometry(&r0, p1.period_size, p1.buffer_size);
+    open_route_stream_repeated(&r0);
+    if (terminating) {
+        end_call();
+        return 1;
+    }
+
+    /* We copy whole periods between streams */
+    if (r1.period_size != p1.period_size || p0.period_size != p1.period_size ||
+        r0.period_size != p1.period_size) {
+        log_msg("cards negotiated different period sizes\n");
+        end_call();
+        return 1;
+    }
+
+    /* Echo canceller is created with the first call, later it's just reset
+       or even kept as it converged. Backend can be changed between calls
+       by changing vp_config.backend. */
+    pthread_mutex_lock(&vp_lock);
+    if (vp.period_size == r0.period_size) {
+        voice_processing_select(&vp, vp_config.backend);
+        voice_processing_reset(&vp, aec_keep);
+    } else {
+        voice_processing_destroy(&vp);
+        if (voice_processing_init(&vp, r0.period_size, &vp_config, &arena,
+                                  log_msg)) {
+            pthread_mutex_unlock(&vp_lock);
+            log_msg("voice processing init failed\n");
+            end_call();
+            return 1;
+        }
+    }
+    pthread_mutex_unlock(&vp_lock);
+
+    /* Long enough for both buffers, so any reference is still there */
+    if (echo_history_init(&echo_history, 4 * p0.buffer_size, r0.period_size)) {
+        log_msg("echo history alloc failed\n");
+        end_call();
+        return 1;
+    }
+    p0.history = &echo_history;
+
+    if (jitter_target_ms >= 0) {
+        if (jitter_init(&p0_jitter, &p0, jitter_target_ms, jitter_max_ms) ||
+            jitter_init(&p1_jitter, &p1, jitter_target_ms, jitter_max_ms)) {
+            log_msg("jitter buffer init failed\n");
+        }
+    }
+
+    if (drift_comp) {
+        if (drift_init(&p0_drift, &p0, drift_target) ||
+            drift_init(&p1_drift, &p1, drift_target)) {
+            log_msg("drift compensation init failed\n");
+        } else {
+            log_msg("drift compensation enabled\n");
+        }
+    }
+
+    record_begin(&p1, &p0);
+
+    /* In threads mode the streams of one card are serviced by different
+       threads, restarting them together would need locking */
+    if (link_streams && mode != MODE_THREADS) {
+        route_stream_link(&r0, &p0);
+        route_stream_link(&r1, &p1);
+    }
+
+    /* Route sound, until hangup or reopen */
+    do {
+        routing_done = 0;
+        if (mode == MODE_THREADS) {
+            route_threads();
+        } else if (mode == MODE_POLL) {
+            make_realtime("poll");
+            route_poll();
+        } else {
+            make_realtime("routing");
+            route_single_thread();
+        }
+    } while (switch_endpoint());
+
+    p0.drift = p1.drift = 0;
+    p0.jitter = p1.jitter = 0;
+
+    end_call();
+    return control.reopening ? 2 : 0;
 }
 
+
 int main()
 {
     int rc;
-    int started = 0;
     char *logfilename;
-#ifdef USE_SPEEX_AEC
-    SpeexEchoState *echo_state;
-#endif
+    char *modename;
+    struct sigaction sa;
+    int period;
+    int buffer;
 
     // Register for TERM and interrupt signals
-    signal(SIGINT, sighandler);
-    signal(SIGTERM, sighandler);
-
-    blink_aux();                // turn red led on so that we know we started
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = sighandler;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT, &sa, 0);
+    sigaction(SIGTERM, &sa, 0);
+#ifdef USE_PROFILER
+    /* Restarted, so it does not interrupt what routing waits for */
+    sa.sa_handler = profile_sighandler;
+    sa.sa_flags = SA_RESTART;
+    sigaction(SIGUSR1, &sa, 0);
+#endif
 
     logfile = stderr;
     logfilename = getenv("GSM_VOICE_ROUTING_LOGFILE");
@@ -577,75 +4372,151 @@ int main()
             fprintf(stderr, "failed to open logfile %s\n", logfilename);
         }
     }
-    fprintf(logfile, "gsm-voice-routing started\n");
+    log_start();
+    log_msg("gsm-voice-routing started\n");
+
+    led_start();
+    blink_aux();                // turn red led on so that we know we started
+
+    control_start(getenv("GSM_VOICE_ROUTING_CONTROL"));
+    if (getenv("GSM_VOICE_ROUTING_RECORD_DIR")) {
+        record_start(getenv("GSM_VOICE_ROUTING_RECORD_DIR"));
+    }
+
+    modename = getenv("GSM_VOICE_ROUTING_MODE");
+    if (modename && strcmp(modename, "threads") == 0) {
+        mode = MODE_THREADS;
+        log_msg("routing directions in separate threads\n");
+    } else if (modename && strcmp(modename, "poll") == 0) {
+        mode = MODE_POLL;
+        p0.nonblock = r0.nonblock = p1.nonblock = r1.nonblock = 1;
+        log_msg("routing from poll loop\n");
+    } else if (modename && strcmp(modename, "latency") == 0) {
+        mode = MODE_LATENCY;
+        latency_trials = getenv_int("GSM_VOICE_ROUTING_LATENCY_TRIALS", 10);
+        latency_card = getenv_int("GSM_VOICE_ROUTING_LATENCY_CARD", 0);
+        if (latency_trials <= 0) {
+            latency_trials = 1;
+        }
+    }
+
+    /* Checked as signed, negative value would wrap in snd_pcm_uframes_t */
+    period = getenv_int("GSM_VOICE_ROUTING_PERIOD_SIZE", period_size);
+    buffer = getenv_int("GSM_VOICE_ROUTING_BUFFER_SIZE", 4 * period);
+    if (period <= 0 || buffer / 2 < period) {
+        log_msg("invalid geometry period=%d buffer=%d\n", period, buffer);
+        cleanup();
+        return 1;
+    }
+    period_size = period;
+    buffer_size = buffer;
+
+    if (route_stream_config(&p0) || route_stream_config(&r0) ||
+        route_stream_config(&p1) || route_stream_config(&r1) ||
+        endpoints_config()) {
+        cleanup();
+        return 1;
+    }
+    if (getenv("GSM_VOICE_ROUTING_MODEM")) {
+        r1.pcm_name = p1.pcm_name = getenv("GSM_VOICE_ROUTING_MODEM");
+    }
+
+    p0.xrun_fill = p1.xrun_fill = getenv_int("GSM_VOICE_ROUTING_XRUN_FILL", 2);
+    link_streams = getenv_int("GSM_VOICE_ROUTING_LINK", 0);
+    if (link_streams && mode == MODE_THREADS) {
+        log_msg("GSM_VOICE_ROUTING_LINK is ignored in threads mode\n");
+    }
+
+    if (getenv_int("GSM_VOICE_ROUTING_MMAP", 0)) {
+        p0.mmap = r0.mmap = p1.mmap = r1.mmap = 1;
+        log_msg("using mmap access\n");
+    }
 
     /* We want realtime process priority */
     rc = nice(-20);
     if (rc != -20) {
-        fprintf(logfile, "nice() failed\n");
+        log_msg("nice() failed\n");
     }
-#ifdef USE_SPEEX_AEC
-    /* 256=frame (period size), 4096 is filter length (recommended is 1/3 of
-       reverbation time - for 1s it's 8000 / 3 */
-    echo_state = speex_echo_state_init(256, 8192);
-#endif
 
-    /* Open streams - umts first */
-    open_route_stream_repeated(&p1);
-    open_route_stream_repeated(&r1);
-    open_route_stream_repeated(&p0);
-    open_route_stream_repeated(&r0);
-
-    /* Route sound */
-    while (!terminating) {
-
-        /* Recording  - first from internal card (so that we always clean the
-           recording buffer), then UMTS, which can fail */
-        if (route_stream_read(&r0)) {
-            blink_aux();
-            continue;
-        }
+    stats_interval = getenv_int("GSM_VOICE_ROUTING_STATS_INTERVAL", 0);
 
-        rc = route_stream_read(&r1);
-        if (rc == ERR_READ && started) {
-            fprintf(logfile,
-                    "read error after some succesful routing (hangup)\n");
-            break;
-        }
-        if (rc != 0) {
-            continue;
-        }
+    rt_priority = getenv_int("GSM_VOICE_ROUTING_RT_PRIORITY", 0);
+    rt_cpu = getenv_int("GSM_VOICE_ROUTING_CPU", -1);
+    modename = getenv("GSM_VOICE_ROUTING_RT_POLICY");
+    if (modename && strcmp(modename, "rr") == 0) {
+        rt_policy = SCHED_RR;
+    }
+    if (rt_priority > 0 && mlockall(MCL_CURRENT | MCL_FUTURE)) {
+        log_msg("mlockall failed: %s\n", strerror(errno));
+    }
 
-        if (started) {
-            show_progress();
-        } else {
-            fprintf(logfile, "voice routing started\n");
-            started = 1;
-        }
+    vp_config.backend = getenv("GSM_VOICE_ROUTING_AEC");
+    if (voice_processing_find(vp_config.backend) == 0) {
+        log_msg("unknown GSM_VOICE_ROUTING_AEC=%s, using %s\n",
+                vp_config.backend, DEFAULT_BACKEND);
+        vp_config.backend = 0;
+    }
+    vp_config.frame_size = getenv_int("GSM_VOICE_ROUTING_AEC_FRAME", 0);
+    vp_config.tail = getenv_int("GSM_VOICE_ROUTING_AEC_TAIL", 0);
+    vp_config.preprocess = getenv_int("GSM_VOICE_ROUTING_AEC_PREPROCESS", 0);
+    vp_config.auto_tail = getenv_int("GSM_VOICE_ROUTING_AEC_AUTO_TAIL", 0);
+    aec_keep = getenv_int("GSM_VOICE_ROUTING_AEC_KEEP", 0);
+    vp_config.agc = getenv_int("GSM_VOICE_ROUTING_AGC", 0);
+    vp_config.comfort_noise = getenv_int("GSM_VOICE_ROUTING_COMFORT_NOISE", 0);
+    vp_config.vad = getenv_int("GSM_VOICE_ROUTING_VAD", 0);
+    daemon_mode = getenv_int("GSM_VOICE_ROUTING_DAEMON", 0);
 
-#ifdef USE_SPEEX_AEC
-        speex_echo_cancellation(echo_state, (spx_int16_t *) r0.period_buffer,
-                                (spx_int16_t *) p0.period_buffer,
-                                (spx_int16_t *) p1.period_buffer);
+    jitter_target_ms = getenv_int("GSM_VOICE_ROUTING_JITTER_TARGET_MS", -1);
+    jitter_max_ms = getenv_int("GSM_VOICE_ROUTING_JITTER_MAX_MS",
+                               2 * jitter_target_ms + 40);
+    drift_comp = getenv_int("GSM_VOICE_ROUTING_DRIFT_COMP", 0);
+    drift_target = getenv_int("GSM_VOICE_ROUTING_DRIFT_TARGET", 0);
 
-        memmove(p0.period_buffer, r1.period_buffer, r1.period_buffer_size);
-#endif
+    if (arena_init(&arena, arena_size())) {
+        log_msg("arena alloc failed\n");
+        cleanup();
+        return 1;
+    }
+    log_msg("arena %ld bytes%s\n", (long)arena.size,
+            arena.locked ? ", locked" : "");
+    if (recorder.dir && record_init()) {
+        log_msg("call recording alloc failed\n");
+    }
 
-#ifdef USE_WALKIE_TALKIE_AEC
-        memmove(p0.period_buffer, r1.period_buffer, r1.period_buffer_size);
-        memmove(p1.period_buffer, r0.period_buffer, r0.period_buffer_size);
-        reduce_echo(p0.period_buffer, p1.period_buffer, p0.period_size);
-#endif
+    call_watch_init(&call_watch, p1.pcm_name);
 
-        route_stream_write(&p0);
-        route_stream_write(&p1);
+    if (mode == MODE_LATENCY) {
+        p0.pcm_name = r0.pcm_name = endpoints[endpoint_current].pcm_name;
+        rc = latency_card ? latency_test(&p1, &r1) : latency_test(&p0, &r0);
+    } else {
+        do {
+            rc = route_call();
+            if (rc == 1 && daemon_mode && !terminating) {
+                log_msg("call could not be routed, waiting for next one\n");
+                wait_call_end();
+                rc = 0;
+            } else if (rc == 0 && daemon_mode) {
+                log_msg("call ended, waiting for next one\n");
+            }
+        } while ((rc == 2 || (rc == 0 && daemon_mode)) && !terminating);
     }
 
-#ifdef USE_SPEEX_AEC
-    speex_echo_state_destroy(echo_state);
-#endif
+    pthread_mutex_lock(&vp_lock);
+    voice_processing_destroy(&vp);
+    pthread_mutex_unlock(&vp_lock);
+    drift_destroy(&p0_drift);
+    drift_destroy(&p1_drift);
+    route_stream_destroy(&p0);
+    route_stream_destroy(&r0);
+    route_stream_destroy(&p1);
+    route_stream_destroy(&r1);
 
-    fprintf(logfile, "gsm-voice-routing ending\n");
+    if (terminating) {
+        log_msg("gsm-voice-routing ending - signal %d\n", (int) terminating);
+    } else {
+        log_msg("gsm-voice-routing ending\n");
+    }
     cleanup();
-    return 0;
+    arena_destroy(&arena);
+    return rc;
 }
@@ -18,7 +18,8 @@ pkg [
     maintainer="Radek Polak <psonek2@seznam.cz>"
 ]
 
-SOURCES=gsm-voice-routing.c
+HEADERS=voice-processing.h dsp-kernels.h arena.h
+SOURCES=gsm-voice-routing.c voice-processing.c dsp-kernels.c arena.c
 
 # Install rules
 target [
@@ -0,0 +1,858 @@
+/*
+ * GTA04 gsm voice routing utility
+ * Copyright (c) 2012 Radek Polak
+ *
+ * gta04-gsm-voice-routing is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * gta04-gsm-voice-routing is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with gta04-gsm-voice-routing; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <time.h>
+#include <string.h>
+
+#include "voice-processing.h"
+
+static void destroy_states(SpeexEchoState **echo,
+                           SpeexPreprocessState **preprocess)
+{
+    if (*preprocess) {
+        speex_preprocess_state_destroy(*preprocess);
+        *preprocess = 0;
+    }
+    if (*echo) {
+        speex_echo_state_destroy(*echo);
+        *echo = 0;
+    }
+}
+
+static void destroy_echo_state(struct voice_processing *vp)
+{
+    destroy_states(&(vp->echo_state), &(vp->preprocess_state));
+}
+
+static SpeexPreprocessState *create_preprocess_state(int frame_size,
+                                                     SpeexEchoState *echo)
+{
+    SpeexPreprocessState *preprocess;
+    int on = 1;
+
+    preprocess = speex_preprocess_state_init(frame_size, 8000);
+    if (preprocess == 0) {
+        return 0;
+    }
+    speex_preprocess_ctl(preprocess, SPEEX_PREPROCESS_SET_DENOISE, &on);
+    speex_preprocess_ctl(preprocess, SPEEX_PREPROCESS_SET_ECHO_STATE, echo);
+    return preprocess;
+}
+
+static int init_preprocess_state(struct voice_processing *vp)
+{
+    vp->preprocess_state = create_preprocess_state(vp->config.frame_size,
+                                                   vp->echo_state);
+    return vp->preprocess_state ? 0 : -1;
+}
+
+static const struct voice_processing_backend speex_backend;
+static const struct voice_processing_backend speex_preprocess_backend;
+
+/* Preprocessor runs when configured or always with speex-preprocess */
+static int backend_preprocess(struct voice_processing *vp,
+                              const struct voice_processing_backend *backend)
+{
+    return vp->config.preprocess || backend == &speex_preprocess_backend;
+}
+
+/* Canceller and preprocessor (if wanted) of speex backends */
+static int create_states(struct voice_processing *vp,
+                         const struct voice_processing_backend *backend,
+                         int tail, SpeexEchoState **echo,
+                         SpeexPreprocessState **preprocess)
+{
+    int rate = 8000;
+
+    *echo = speex_echo_state_init(vp->config.frame_size, tail);
+    if (*echo == 0) {
+        return -1;
+    }
+    speex_echo_ctl(*echo, SPEEX_ECHO_SET_SAMPLING_RATE, &rate);
+
+    *preprocess = 0;
+    if (backend_preprocess(vp, backend)) {
+        *preprocess = create_preprocess_state(vp->config.frame_size, *echo);
+        if (*preprocess == 0) {
+            destroy_states(echo, preprocess);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int init_echo_state(struct voice_processing *vp)
+{
+    return create_states(vp, vp->backend, vp->config.tail,
+                         &(vp->echo_state), &(vp->preprocess_state));
+}
+
+static long long now_us()
+{
+    struct timespec tp;
+    clock_gettime(CLOCK_MONOTONIC, &tp);
+    return tp.tv_sec * 1000000LL + tp.tv_nsec / 1000;
+}
+
+/* Halve the tail if processing takes too long. The canceller has to converge
+   again after that, so we never make the tail longer again. */
+static void auto_tail(struct voice_processing *vp, long long us)
+{
+    long long period_us = vp->period_size * 1000000LL / 8000;
+    long long limit = AUTO_TAIL_PERIODS * period_us * vp->config.auto_tail;
+
+    vp->busy_us += us;
+    if (++(vp->busy_periods) < AUTO_TAIL_PERIODS) {
+        return;
+    }
+    /* Shorter canceller is built by voice_processing_maintain(), we only
+       ask for it if nothing is asked yet (or it failed before) */
+    if (vp->busy_us * 100 > limit && vp->config.tail / 2 >= AUTO_TAIL_MIN &&
+        __atomic_load_n(&(vp->want_tail), __ATOMIC_ACQUIRE) == 0) {
+        __atomic_store_n(&(vp->want_tail), vp->config.tail / 2,
+                         __ATOMIC_RELEASE);
+        if (vp->log) {
+            vp->log("processing takes %lld us per period, "
+                    "shortening echo canceller tail to %d\n",
+                    vp->busy_us / vp->busy_periods, vp->config.tail / 2);
+        }
+    }
+    vp->busy_us = 0;
+    vp->busy_periods = 0;
+}
+
+static int gcd(int a, int b)
+{
+    while (b) {
+        int t = a % b;
+        a = b;
+        b = t;
+    }
+    return a;
+}
+
+/* Blocks from arena can't be freed, they are kept for the next init */
+static void free_fifos(struct voice_processing *vp)
+{
+    if (vp->arena) {
+        return;
+    }
+    arena_free(vp->arena, vp->near_fifo);
+    arena_free(vp->arena, vp->far_fifo);
+    arena_free(vp->arena, vp->out_fifo);
+    vp->near_fifo = vp->far_fifo = vp->out_fifo = 0;
+}
+
+/* Empty input fifos, output fifo starts with silence */
+static void reset_fifos(struct voice_processing *vp)
+{
+    int frame = vp->config.frame_size;
+
+    vp->in_fill = 0;
+    vp->out_fill = frame - gcd(vp->period_size, frame);
+    memset(vp->out_fifo, 0, vp->out_fill * sizeof(s16));
+}
+
+static int alloc_fifos(struct voice_processing *vp)
+{
+    int frame = vp->config.frame_size;
+    int in_size = (frame + vp->period_size) * sizeof(s16);
+    int out_size = (2 * frame + vp->period_size) * sizeof(s16);
+
+    /* Kept from previous init are big enough */
+    if (vp->near_fifo && in_size <= vp->in_size && out_size <= vp->out_size) {
+        reset_fifos(vp);
+        return 0;
+    }
+
+    free_fifos(vp);
+    vp->near_fifo = arena_alloc(vp->arena, in_size);
+    vp->far_fifo = arena_alloc(vp->arena, in_size);
+    vp->out_fifo = arena_alloc(vp->arena, out_size);
+    if (!vp->near_fifo || !vp->far_fifo || !vp->out_fifo) {
+        free_fifos(vp);
+        vp->near_fifo = vp->far_fifo = vp->out_fifo = 0;
+        vp->in_size = vp->out_size = 0;
+        return -1;
+    }
+    vp->in_size = in_size;
+    vp->out_size = out_size;
+    reset_fifos(vp);
+    return 0;
+}
+
+static void voice_activity_reset(struct voice_activity *va)
+{
+    va->env = 0;
+    va->floor = 0;
+    va->hangover = 0;
+}
+
+/* Move value towards target, by count/time of the difference */
+static int follow(int value, int target, int count, int time)
+{
+    if (count >= time) {
+        return target;
+    }
+    return value + (target - value) * count / time;
+}
+
+/* Update envelope and floor with level of the frame, returns 1 if the side
+   is active or was active less than hangover frames ago */
+static int voice_activity_update(struct voice_activity *va, const s16 *buf,
+                                 int count, int hangover)
+{
+    int level = dsp_sum_abs(buf, count) / count;
+
+    va->env = follow(va->env, level, count,
+                     level > va->env ? VAD_ENV_ATTACK : VAD_ENV_RELEASE);
+    if (va->env < va->floor) {
+        va->floor = va->env;
+    } else {
+        va->floor += va->floor * count / VAD_FLOOR_RISE + 1;
+    }
+
+    if (va->env >= VAD_MIN_LEVEL && va->env >= VAD_SNR * va->floor) {
+        va->hangover = hangover;
+        return 1;
+    }
+    if (va->hangover > 0) {
+        va->hangover -= count;
+        return 1;
+    }
+    return 0;
+}
+
+/* Cancel echo in all whole frames from input fifos into output fifo */
+static void cancel_frames(struct voice_processing *vp)
+{
+    int frame = vp->config.frame_size;
+    int i;
+
+    for (i = 0; i + frame <= vp->in_fill; i += frame) {
+        s16 *out = vp->out_fifo + vp->out_fill;
+        if (vp->config.vad) {
+            vp->vad_frames += frame;
+        }
+        if (vp->config.vad &&
+            !voice_activity_update(&(vp->far_activity), vp->far_fifo + i,
+                                   frame, vp->config.tail)) {
+            memcpy(out, vp->near_fifo + i, frame * sizeof(s16));
+            vp->vad_bypassed += frame;
+        } else {
+            speex_echo_cancellation(vp->echo_state,
+                                    (const spx_int16_t *) vp->near_fifo + i,
+                                    (const spx_int16_t *) vp->far_fifo + i,
+                                    (spx_int16_t *) out);
+        }
+        if (vp->preprocess_state) {
+            speex_preprocess_run(vp->preprocess_state, (spx_int16_t *) out);
+        }
+        vp->out_fill += frame;
+    }
+    if (i > 0) {
+        vp->in_fill -= i;
+        memmove(vp->near_fifo, vp->near_fifo + i, vp->in_fill * sizeof(s16));
+        memmove(vp->far_fifo, vp->far_fifo + i, vp->in_fill * sizeof(s16));
+    }
+}
+
+static int frame_size(int period_size,
+                      const struct voice_processing_config *config)
+{
+    if (config->frame_size > 0) {
+        return config->frame_size;
+    }
+    return ((MIN_FRAME + period_size - 1) / period_size) * period_size;
+}
+
+size_t voice_processing_memory(int period_size,
+                               const struct voice_processing_config *config)
+{
+    int frame = frame_size(period_size, config);
+
+    /* Fifos are there for any backend, so it can be switched without
+       allocating */
+    return 2 * ARENA_BLOCK((frame + period_size) * sizeof(s16)) +
+        ARENA_BLOCK((2 * frame + period_size) * sizeof(s16));
+}
+
+static void walkie_talkie_reset(struct walkie_talkie *wt)
+{
+    int i;
+
+    for (i = 0; i < 2; i++) {
+        wt->env[i] = 0;
+        wt->floor[i] = 32767;   // goes down to real floor with first period
+        wt->gain[i] = DSP_GAIN_ONE;
+    }
+    wt->state = ECHO_NONE;
+    wt->hangover = 0;
+}
+
+/* Update envelope and floor with level of the period, returns how many times
+   is the envelope over floor in Q4 or 0 if the side is not active */
+static int walkie_talkie_side(struct walkie_talkie *wt, int i, s16 *buf,
+                              int count)
+{
+    int level = dsp_sum_abs(buf, count) / count;
+
+    wt->env[i] = follow(wt->env[i], level, count,
+                        level > wt->env[i] ? WT_ENV_ATTACK : WT_ENV_RELEASE);
+    if (wt->env[i] < wt->floor[i]) {
+        wt->floor[i] = wt->env[i];
+    } else {
+        wt->floor[i] += wt->floor[i] * count / WT_FLOOR_RISE + 1;
+    }
+
+    if (wt->env[i] < WT_MIN_LEVEL || wt->env[i] < WT_SNR * wt->floor[i]) {
+        return 0;
+    }
+    return wt->env[i] * 16 / (wt->floor[i] + 1);
+}
+
+/* Ramp gain of one side towards target */
+static void walkie_talkie_gain(struct walkie_talkie *wt, int i, s16 *buf,
+                               int count, int target)
+{
+    int gain = wt->gain[i];
+    int step;
+
+    if (target < gain) {
+        step = DSP_GAIN_ONE * count / WT_DUCK_RAMP;
+        gain = gain - step < target ? target : gain - step;
+    } else {
+        step = DSP_GAIN_ONE * count / WT_RECOVER_RAMP;
+        gain = gain + step > target ? target : gain + step;
+    }
+    dsp_gain_ramp(buf, count, wt->gain[i], gain);
+    wt->gain[i] = gain;
+}
+
+/* Reduce echo by adjusting volumes in playback and record buffer with walkie
+   talkie like algorithm described in voice-processing.h. */
+static int walkie_talkie_duplex(struct voice_processing *vp, s16 *playback,
+                                s16 *record)
+{
+    struct walkie_talkie *wt = &(vp->wt);
+    int count = vp->period_size;
+    int far = walkie_talkie_side(wt, 0, playback, count);
+    int near = walkie_talkie_side(wt, 1, record, count);
+    int want = ECHO_NONE;
+
+    if (far > 0 && far >= near) {
+        want = ECHO_LISTENING;
+    } else if (near > 0) {
+        want = ECHO_TALKING;
+    }
+
+    if (want == wt->state) {
+        wt->hangover = WT_HANGOVER;
+    } else if (wt->state != ECHO_NONE && wt->hangover > 0) {
+        wt->hangover -= count;
+    } else {
+        wt->state = want;
+        wt->hangover = WT_HANGOVER;
+    }
+
+    if (wt->state == ECHO_LISTENING) {
+        walkie_talkie_gain(wt, 0, playback, count, WT_BOOST_GAIN);
+        walkie_talkie_gain(wt, 1, record, count, WT_DUCK_GAIN);
+    } else if (wt->state == ECHO_TALKING) {
+        walkie_talkie_gain(wt, 0, playback, count, WT_DUCK_GAIN);
+        walkie_talkie_gain(wt, 1, record, count, WT_BOOST_GAIN);
+    } else {
+        walkie_talkie_gain(wt, 0, playback, count, DSP_GAIN_ONE);
+        walkie_talkie_gain(wt, 1, record, count, DSP_GAIN_ONE);
+    }
+    return wt->state;
+}
+
+static void voice_level_reset(struct voice_level *l)
+{
+    l->env = 0;
+    l->gain = DSP_GAIN_ONE;
+}
+
+/* Ramp agc gain towards target for envelope of the input, see
+   voice-processing.h. Gain is held when hold is set. */
+static void voice_level_agc(struct voice_level *l, int target, s16 *buf,
+                            int count, int hold)
+{
+    int level = dsp_sum_abs(buf, count) / count;
+    int want = l->gain;
+    int gain = l->gain;
+    int step;
+
+    l->env = follow(l->env, level, count,
+                    level > l->env ? AGC_ENV_ATTACK : AGC_ENV_RELEASE);
+    if (!hold && l->env >= AGC_GATE_LEVEL) {
+        want = (long long) target * DSP_GAIN_ONE / l->env;
+        if (want < AGC_MIN_GAIN) {
+            want = AGC_MIN_GAIN;
+        } else if (want > AGC_MAX_GAIN) {
+            want = AGC_MAX_GAIN;
+        }
+    }
+
+    if (want < gain) {
+        step = DSP_GAIN_ONE * count / AGC_FALL;
+        gain = gain - step < want ? want : gain - step;
+    } else {
+        step = DSP_GAIN_ONE * count / AGC_RISE;
+        gain = gain + step > want ? want : gain + step;
+    }
+    if (gain != DSP_GAIN_ONE || l->gain != DSP_GAIN_ONE) {
+        dsp_gain_ramp(buf, count, l->gain, gain);
+    }
+    l->gain = gain;
+}
+
+/* Add white noise of mean absolute value level if the period is quieter.
+   Uniform noise on [-2 * level, 2 * level] has mean absolute value level. */
+static void voice_level_comfort_noise(struct voice_level *l, int level,
+                                      s16 *buf, int count)
+{
+    int range = 4 * level + 1;
+    int sample;
+    int i;
+
+    if (dsp_sum_abs(buf, count) >= (unsigned int) level * count) {
+        return;
+    }
+    for (i = 0; i < count; i++) {
+        l->noise = l->noise * 1103515245 + 12345;
+        sample = buf[i] + (int) ((l->noise >> 16) % range) - 2 * level;
+        buf[i] = sample > 32767 ? 32767 : (sample < -32768 ? -32768 : sample);
+    }
+}
+
+/* Level stages of direction i */
+static void voice_level_process(struct voice_processing *vp, int i, s16 *buf,
+                                int hold)
+{
+    if (vp->config.agc > 0) {
+        voice_level_agc(&(vp->level[i]), vp->config.agc, buf,
+                        vp->period_size, hold);
+    }
+    if (vp->config.comfort_noise > 0) {
+        voice_level_comfort_noise(&(vp->level[i]), vp->config.comfort_noise,
+                                  buf, vp->period_size);
+    }
+}
+
+/* "none" - uplink is the microphone as is */
+
+static int none_init(struct voice_processing *vp)
+{
+    return 0;
+}
+
+static void none_reset(struct voice_processing *vp, int keep)
+{
+}
+
+static void none_destroy(struct voice_processing *vp)
+{
+}
+
+static int none_uplink(struct voice_processing *vp, const s16 *near,
+                       s16 *far, s16 *out)
+{
+    memmove(out, near, vp->period_size * sizeof(s16));
+    return -1;
+}
+
+/* "walkie" - half duplex volume adjusting */
+
+static int walkie_init(struct voice_processing *vp)
+{
+    walkie_talkie_reset(&(vp->wt));
+    return 0;
+}
+
+static void walkie_reset(struct voice_processing *vp, int keep)
+{
+    walkie_talkie_reset(&(vp->wt));
+}
+
+/* Only the uplink volume is adjusted, far is just a copy of what was
+   already played */
+static int walkie_uplink(struct voice_processing *vp, const s16 *near,
+                         s16 *far, s16 *out)
+{
+    memmove(out, near, vp->period_size * sizeof(s16));
+    return walkie_talkie_duplex(vp, far, out);
+}
+
+/* "speex" and "speex-preprocess" - speex echo canceller */
+
+static int speex_init(struct voice_processing *vp)
+{
+    reset_fifos(vp);
+    vp->busy_us = 0;
+    vp->busy_periods = 0;
+    voice_activity_reset(&(vp->far_activity));
+    if (init_echo_state(vp)) {
+        return -1;
+    }
+    if (vp->log) {
+        vp->log("echo canceller frame %d, tail %d%s%s, framing latency "
+                "%d frames\n", vp->config.frame_size, vp->config.tail,
+                vp->preprocess_state ? ", with preprocessor" : "",
+                vp->config.vad ? ", bypassed while far end is silent" : "",
+                vp->out_fill);
+    }
+    return 0;
+}
+
+/* Echo canceller starts from scratch unless keep is set, then it starts
+   with the filter converged in previous call. */
+static void speex_reset(struct voice_processing *vp, int keep)
+{
+    reset_fifos(vp);
+    vp->busy_us = 0;
+    vp->busy_periods = 0;
+    voice_activity_reset(&(vp->far_activity));
+    if (keep || vp->echo_state == 0) {
+        return;
+    }
+    speex_echo_state_reset(vp->echo_state);
+
+    /* Preprocessor has no reset, noise estimate is from the last call */
+    if (vp->preprocess_state) {
+        speex_preprocess_state_destroy(vp->preprocess_state);
+        vp->preprocess_state = 0;
+        init_preprocess_state(vp);
+    }
+}
+
+static int speex_uplink(struct voice_processing *vp, const s16 *near,
+                        s16 *far, s16 *out)
+{
+    long long start = vp->config.auto_tail > 0 ? now_us() : 0;
+    int n = vp->period_size;
+
+    memcpy(vp->near_fifo + vp->in_fill, near, n * sizeof(s16));
+    memcpy(vp->far_fifo + vp->in_fill, far, n * sizeof(s16));
+    vp->in_fill += n;
+    cancel_frames(vp);
+
+    memcpy(out, vp->out_fifo, n * sizeof(s16));
+    vp->out_fill -= n;
+    memmove(vp->out_fifo, vp->out_fifo + n, vp->out_fill * sizeof(s16));
+
+    if (vp->config.auto_tail > 0) {
+        auto_tail(vp, now_us() - start);
+    }
+    return -1;
+}
+
+static const struct voice_processing_backend none_backend = {
+    "none", none_init, none_reset, none_destroy, none_uplink, 0
+};
+
+static const struct voice_processing_backend walkie_backend = {
+    "walkie", walkie_init, walkie_reset, none_destroy, walkie_uplink,
+    walkie_talkie_duplex
+};
+
+static const struct voice_processing_backend speex_backend = {
+    "speex", speex_init, speex_reset, destroy_echo_state, speex_uplink, 0
+};
+
+static const struct voice_processing_backend speex_preprocess_backend = {
+    "speex-preprocess", speex_init, speex_reset, destroy_echo_state,
+    speex_uplink, 0
+};
+
+const struct voice_processing_backend *const voice_processing_backends[] = {
+    &none_backend, &walkie_backend, &speex_backend, &speex_preprocess_backend,
+    0
+};
+
+const struct voice_processing_backend *voice_processing_find(const char *name)
+{
+    int i;
+
+    if (name == 0 || name[0] == 0) {
+        name = DEFAULT_BACKEND;
+    }
+    for (i = 0; voice_processing_backends[i]; i++) {
+        if (strcmp(voice_processing_backends[i]->name, name) == 0) {
+            return voice_processing_backends[i];
+        }
+    }
+    return 0;
+}
+
+/* Free spare state, whether built and not swapped in or retired */
+static void drop_spare(struct voice_processing *vp)
+{
+    destroy_states(&(vp->spare_echo_state), &(vp->spare_preprocess_state));
+    vp->spare_backend = 0;
+    __atomic_store_n(&(vp->swap), SWAP_IDLE, __ATOMIC_RELEASE);
+}
+
+void voice_processing_request(struct voice_processing *vp,
+                              const struct voice_processing_backend *backend)
+{
+    __atomic_store_n(&(vp->want_backend), backend, __ATOMIC_RELEASE);
+}
+
+/* Normal priority thread: free what the swap retired and build the state
+   of requested backend or shorter tail auto_tail asked for. The routing
+   thread does not touch spare until it's published as SWAP_READY. */
+void voice_processing_maintain(struct voice_processing *vp)
+{
+    const struct voice_processing_backend *backend;
+    int shorter;
+    int tail;
+
+    if (vp->period_size == 0) {
+        return;
+    }
+    if (__atomic_load_n(&(vp->swap), __ATOMIC_ACQUIRE) == SWAP_RETIRED) {
+        drop_spare(vp);
+    }
+    if (__atomic_load_n(&(vp->swap), __ATOMIC_ACQUIRE) != SWAP_IDLE) {
+        return;
+    }
+    backend = __atomic_exchange_n(&(vp->want_backend), 0, __ATOMIC_ACQUIRE);
+    if (backend == vp->backend) {
+        backend = 0;
+    }
+
+    /* Routing thread does not change want_tail until we clear it */
+    shorter = __atomic_load_n(&(vp->want_tail), __ATOMIC_ACQUIRE);
+    if (shorter > 0) {
+        __atomic_store_n(&(vp->want_tail), 0, __ATOMIC_RELEASE);
+    } else {
+        shorter = 0;
+    }
+    if (backend == 0 && shorter == 0) {
+        return;
+    }
+    if (backend == 0) {
+        backend = vp->backend;
+    }
+    tail = shorter ? shorter : vp->config.tail;
+
+    if ((backend == &speex_backend || backend == &speex_preprocess_backend) &&
+        create_states(vp, backend, tail, &(vp->spare_echo_state),
+                      &(vp->spare_preprocess_state))) {
+        if (vp->log) {
+            vp->log("echo suppression backend %s tail %d init failed, "
+                    "keeping %s tail %d\n", backend->name, tail,
+                    vp->backend->name, vp->config.tail);
+        }
+
+        /* Don't let auto_tail ask again in this call */
+        if (shorter) {
+            __atomic_store_n(&(vp->want_tail), -1, __ATOMIC_RELEASE);
+        }
+        return;
+    }
+    vp->spare_backend = backend;
+    vp->spare_tail = tail;
+    vp->spare_frame_size = vp->config.frame_size;
+    __atomic_store_n(&(vp->swap), SWAP_READY, __ATOMIC_RELEASE);
+}
+
+/* Routing thread at period boundary: exchange current state with the spare
+   built by voice_processing_maintain(), which frees the old one later.
+   Only pointers are moved, nothing is allocated or freed here. */
+void voice_processing_swap(struct voice_processing *vp)
+{
+    const struct voice_processing_backend *backend;
+    SpeexEchoState *echo;
+    SpeexPreprocessState *preprocess;
+    int tail;
+
+    if (__atomic_load_n(&(vp->swap), __ATOMIC_ACQUIRE) != SWAP_READY) {
+        return;
+    }
+
+    /* Built for the fifos of previous call, just let it be freed */
+    if (vp->spare_frame_size != vp->config.frame_size) {
+        __atomic_store_n(&(vp->swap), SWAP_RETIRED, __ATOMIC_RELEASE);
+        return;
+    }
+
+    backend = vp->backend;
+    echo = vp->echo_state;
+    preprocess = vp->preprocess_state;
+    tail = vp->config.tail;
+    vp->backend = vp->spare_backend;
+    vp->echo_state = vp->spare_echo_state;
+    vp->preprocess_state = vp->spare_preprocess_state;
+    vp->config.tail = vp->spare_tail;
+    vp->spare_backend = backend;
+    vp->spare_echo_state = echo;
+    vp->spare_preprocess_state = preprocess;
+    vp->spare_tail = tail;
+
+    reset_fifos(vp);
+    vp->busy_us = 0;
+    vp->busy_periods = 0;
+    voice_activity_reset(&(vp->far_activity));
+    walkie_talkie_reset(&(vp->wt));
+    __atomic_store_n(&(vp->swap), SWAP_RETIRED, __ATOMIC_RELEASE);
+
+    if (vp->log && vp->backend == backend) {
+        vp->log("echo canceller tail shortened to %d\n", vp->config.tail);
+    } else if (vp->log) {
+        vp->log("echo suppression backend %s, tail %d\n", vp->backend->name,
+                vp->config.tail);
+    }
+}
+
+/* Switch backend, state of the new one starts from scratch. If it can't be
+   created, we continue with "none" and return -1. */
+int voice_processing_select(struct voice_processing *vp, const char *name)
+{
+    const struct voice_processing_backend *backend = voice_processing_find(name);
+
+    /* Whatever was prepared for the routing thread is replaced */
+    drop_spare(vp);
+
+    if (backend == 0) {
+        if (vp->log) {
+            vp->log("unknown echo suppression backend %s\n", name);
+        }
+        return -1;
+    }
+    if (backend == vp->backend) {
+        return 0;
+    }
+    if (vp->backend) {
+        vp->backend->destroy(vp);
+    }
+    vp->backend = backend;
+    if (backend->init(vp)) {
+        if (vp->log) {
+            vp->log("echo suppression backend %s init failed\n", backend->name);
+        }
+        vp->backend = &none_backend;
+        return -1;
+    }
+    if (vp->log) {
+        vp->log("echo suppression backend %s\n", backend->name);
+    }
+    return 0;
+}
+
+int voice_processing_init(struct voice_processing *vp, int period_size,
+                          const struct voice_processing_config *config,
+                          struct arena *arena,
+                          void (*log)(const char *fmt, ...))
+{
+    s16 *fifos[3] = { 0, 0, 0 };
+    int in_size = 0;
+    int out_size = 0;
+
+    /* Fifos taken from the same arena before are reused */
+    if (arena && vp->arena == arena) {
+        fifos[0] = vp->near_fifo;
+        fifos[1] = vp->far_fifo;
+        fifos[2] = vp->out_fifo;
+        in_size = vp->in_size;
+        out_size = vp->out_size;
+    }
+    memset(vp, 0, sizeof(*vp));
+    vp->near_fifo = fifos[0];
+    vp->far_fifo = fifos[1];
+    vp->out_fifo = fifos[2];
+    vp->in_size = in_size;
+    vp->out_size = out_size;
+    vp->period_size = period_size;
+    vp->config = *config;
+    vp->config.frame_size = frame_size(period_size, config);
+    vp->arena = arena;
+    vp->log = log;
+    if (vp->config.tail <= 0) {
+        vp->config.tail = DEFAULT_TAIL;
+    }
+    voice_level_reset(&(vp->level[LEVEL_DOWNLINK]));
+    voice_level_reset(&(vp->level[LEVEL_UPLINK]));
+
+    /* Different noise in each direction, so it does not correlate */
+    vp->level[LEVEL_DOWNLINK].noise = 0x2545f491;
+    vp->level[LEVEL_UPLINK].noise = 0x9e3779b9;
+
+    if (alloc_fifos(vp)) {
+        return -1;
+    }
+    if (voice_processing_select(vp, config->backend)) {
+        voice_processing_destroy(vp);
+        return -1;
+    }
+    return 0;
+}
+
+/* Prepare for the next call, keep is only used by speex */
+void voice_processing_reset(struct voice_processing *vp, int keep)
+{
+    vp->backend->reset(vp, keep);
+    vp->vad_frames = 0;
+    vp->vad_bypassed = 0;
+
+    /* auto_tail may try again */
+    __atomic_store_n(&(vp->want_tail), 0, __ATOMIC_RELEASE);
+    voice_level_reset(&(vp->level[LEVEL_DOWNLINK]));
+    voice_level_reset(&(vp->level[LEVEL_UPLINK]));
+}
+
+void voice_processing_destroy(struct voice_processing *vp)
+{
+    drop_spare(vp);
+    if (vp->backend) {
+        vp->backend->destroy(vp);
+        vp->backend = 0;
+    }
+    free_fifos(vp);
+    vp->period_size = 0;
+}
+
+int voice_processing_uplink(struct voice_processing *vp, const s16 *near,
+                            s16 *far, s16 *out)
+{
+    int state = vp->backend->uplink(vp, near, far, out);
+
+    voice_level_process(vp, LEVEL_UPLINK, out, state == ECHO_LISTENING);
+    return state;
+}
+
+void voice_processing_downlink(struct voice_processing *vp, s16 *buf)
+{
+    voice_level_process(vp, LEVEL_DOWNLINK, buf, 0);
+}
+
+int voice_processing_duplex(struct voice_processing *vp, s16 *playback,
+                            s16 *record)
+{
+    int state;
+
+    if (vp->backend->duplex == 0) {
+        return -1;
+    }
+    state = vp->backend->duplex(vp, playback, record);
+    voice_level_process(vp, LEVEL_UPLINK, record, state == ECHO_LISTENING);
+    return state;
+}
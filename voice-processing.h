@@ -0,0 +1,314 @@
+/*
+ * GTA04 gsm voice routing utility
+ * Copyright (c) 2012 Radek Polak
+ *
+ * gta04-gsm-voice-routing is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * gta04-gsm-voice-routing is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with gta04-gsm-voice-routing; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/*
+
+Sound processing stages shared by gsm-voice-routing and
+gsm-voice-routing-bench. Nothing here depends on ALSA, stages work on plain
+periods of S16 mono samples.
+
+Echo suppression is done by one of the backends, each is a table of
+init/reset/destroy/uplink functions (struct voice_processing_backend), so it
+can be chosen at startup or switched between calls with
+voice_processing_select(). During a call the routing thread must not
+allocate, so the new backend's state is built by another thread with
+voice_processing_maintain() into spare fields and the routing thread only
+exchanges pointers in voice_processing_swap() (SWAP_* state):
+
+none             - microphone goes to uplink as is, costs nothing
+walkie           - half duplex volume adjusting, see below; it also has
+                   duplex processing which ducks the playback itself
+speex            - speex echo canceller
+speex-preprocess - speex echo canceller followed by preprocessor
+
+Speex echo canceller is configured by struct voice_processing_config:
+
+frame_size - frames processed by canceller at once, independent of the
+             period size (see below)
+tail       - filter length in frames, recommended is 1/3 of reverberation
+             time, it's also what the canceller costs most cpu for
+preprocess - run speex preprocessor after the canceller - denoise and
+             residual echo suppression
+auto_tail  - when processing takes more than auto_tail percent of the period
+             duration on average, tail is halved (down to AUTO_TAIL_MIN);
+             the routing thread only asks for it, shorter canceller is
+             built by voice_processing_maintain() and swapped in, if that
+             fails the current one is kept
+vad        - bypass the canceller while far end is silent, see below
+
+Audio is re-blocked from periods into canceller frames: near and far periods
+are appended to input fifos, each whole frame there is cancelled into output
+fifo and one period is taken from output fifo. To always have a whole period
+in output fifo, it starts with frame_size - gcd(period_size, frame_size)
+frames of silence, so there is no extra latency when frame is a multiple or
+divisor of the period. Default frame is the smallest multiple of period that
+is at least MIN_FRAME (10ms), so small periods can be used for low latency
+while the canceller still gets frames it converges well with.
+
+Most of a call is silence in each direction and when nothing is played
+there is no echo to cancel. With vad, level of each far frame is followed
+like walkie talkie does for periods (VAD_* envelope and noise floor) and
+while far end is inactive, near frame goes to the output (and preprocessor)
+as is, without calling the canceller. That also freezes filter adaptation,
+so it does not drift on near end noise. Far end stays active for tail frames
+after it went quiet, so the echo still in the room is cancelled.
+
+Walkie talkie echo reduction is half duplex: only the louder side is heard.
+For speaker (far) and microphone (near) we follow envelope of period levels
+(mean absolute sample) with WT_ENV_ATTACK/WT_ENV_RELEASE time constants and
+track noise floor under it - floor follows envelope down immediately and
+rises slowly (doubles in WT_FLOOR_RISE). Side is active when its envelope is
+WT_SNR times over its floor and over WT_MIN_LEVEL, so the threshold adapts
+to background noise. Active side with better envelope/floor ratio wins. The
+direction is kept for WT_HANGOVER after its side goes quiet, so pauses
+between words do not switch it. Gains are ramped sample by sample towards
+WT_BOOST_GAIN for the winner and WT_DUCK_GAIN for the other side, ducking in
+WT_DUCK_RAMP and recovering in WT_RECOVER_RAMP. All times are in frames.
+
+After echo suppression both directions go through the same level stages,
+each direction with its own state (struct voice_level): downlink with
+voice_processing_downlink() before it's played (so echo suppression gets the
+reference at played level too), uplink at the end of
+voice_processing_uplink() and voice_processing_duplex().
+
+agc           - automatic gain control, config.agc is the target level (mean
+                absolute sample). Envelope of period levels is followed with
+                AGC_ENV_ATTACK/AGC_ENV_RELEASE and gain is ramped towards
+                agc/envelope, limited to AGC_MIN_GAIN..AGC_MAX_GAIN, rising
+                by DSP_GAIN_ONE in AGC_RISE frames and falling in AGC_FALL.
+                Under AGC_GATE_LEVEL (pauses, background noise) and while
+                walkie talkie is listening the gain is held, so noise is not
+                pulled up and ducking is not undone.
+comfort noise - period quieter than config.comfort_noise (mean absolute
+                sample) gets white noise of that level added, so silenced
+                or suppressed periods do not sound like a dropped call.
+
+Both are off (0) by default and cost one sum of absolute values per period
+when on.
+
+*/
+
+#ifndef VOICE_PROCESSING_H
+#define VOICE_PROCESSING_H
+
+#include <speex/speex_echo.h>
+#include <speex/speex_preprocess.h>
+
+#include "arena.h"
+#include "dsp-kernels.h"
+
+#define s16 short
+#define u16 unsigned short
+
+/* Walkie talkie state returned by uplink and duplex processing */
+#define ECHO_NONE 0
+#define ECHO_LISTENING 1
+#define ECHO_TALKING 2
+
+/* Walkie talkie tuning, see above */
+#define WT_ENV_ATTACK 80
+#define WT_ENV_RELEASE 800
+#define WT_FLOOR_RISE 16000
+#define WT_SNR 3
+#define WT_MIN_LEVEL 16
+#define WT_HANGOVER 1600
+#define WT_BOOST_GAIN (2 * DSP_GAIN_ONE)
+#define WT_DUCK_GAIN (DSP_GAIN_ONE / 16)
+#define WT_DUCK_RAMP 80
+#define WT_RECOVER_RAMP 800
+
+/* Automatic gain control tuning, see above, times are in frames */
+#define AGC_ENV_ATTACK 80
+#define AGC_ENV_RELEASE 1600
+#define AGC_GATE_LEVEL 64
+#define AGC_MIN_GAIN (DSP_GAIN_ONE / 4)
+#define AGC_MAX_GAIN (6 * DSP_GAIN_ONE)
+#define AGC_RISE 8000
+#define AGC_FALL 80
+
+/* Level stage index of direction */
+#define LEVEL_DOWNLINK 0
+#define LEVEL_UPLINK 1
+
+/* Far end voice activity detection tuning, see above, times are in frames */
+#define VAD_ENV_ATTACK 80
+#define VAD_ENV_RELEASE 800
+#define VAD_FLOOR_RISE 16000
+#define VAD_SNR 3
+#define VAD_MIN_LEVEL 16
+
+/* Backend used when none is configured */
+#define DEFAULT_BACKEND "speex"
+
+/* Default filter length in frames (256ms), echo reference is aligned with
+   the microphone, so it only has to cover the acoustic path */
+#define DEFAULT_TAIL 2048
+
+/* Shortest default canceller frame (10ms) */
+#define MIN_FRAME 80
+
+/* Shortest tail auto_tail can make */
+#define AUTO_TAIL_MIN 256
+
+/* Periods over which we average processing time for auto_tail */
+#define AUTO_TAIL_PERIODS 100
+
+/* Spare state of voice_processing, who owns it */
+#define SWAP_IDLE 0             // maintain thread, nothing built
+#define SWAP_READY 1            // built, routing thread may swap it in
+#define SWAP_RETIRED 2          // old state swapped out, maintain frees it
+
+struct voice_processing_config
+{
+    int frame_size;             // canceller frame, 0 = default
+    int tail;                   // filter length in frames, 0 = DEFAULT_TAIL
+    int preprocess;             // denoise and residual echo suppression
+    int auto_tail;              // max % of period processing may take, 0 = off
+    const char *backend;        // backend name, 0 = DEFAULT_BACKEND
+    int agc;                    // target level of both directions, 0 = off
+    int comfort_noise;          // level of noise in quiet periods, 0 = off
+    int vad;                    // bypass canceller while far end is silent
+};
+
+/* Walkie talkie state, index 0 is far and 1 is near */
+struct walkie_talkie
+{
+    int env[2];                 // envelope of period levels
+    int floor[2];               // noise floor
+    int gain[2];                // current gain, Q12
+    int state;                  // ECHO_*
+    int hangover;               // frames before direction can change
+};
+
+/* Level stages state of one direction */
+struct voice_level
+{
+    int env;                    // envelope of period levels before agc
+    int gain;                   // current agc gain, Q12
+    unsigned int noise;         // comfort noise generator state
+};
+
+/* Voice activity of one side */
+struct voice_activity
+{
+    int env;                    // envelope of frame levels
+    int floor;                  // noise floor
+    int hangover;               // frames the side stays active
+};
+
+struct voice_processing;
+
+/* Echo suppression backend, one function table per algorithm */
+struct voice_processing_backend
+{
+    const char *name;
+    int (*init)(struct voice_processing *vp);   // 0 on success
+    void (*reset)(struct voice_processing *vp, int keep);
+    void (*destroy)(struct voice_processing *vp);
+    int (*uplink)(struct voice_processing *vp, const s16 *near, s16 *far,
+                  s16 *out);
+    int (*duplex)(struct voice_processing *vp, s16 *playback, s16 *record);
+};
+
+/* All backends, terminated by 0 */
+extern const struct voice_processing_backend *const voice_processing_backends[];
+
+struct voice_processing
+{
+    int period_size;            // frames in one period
+    struct voice_processing_config config;
+    void (*log)(const char *fmt, ...);  // where to report changes, can be 0
+    struct arena *arena;        // memory for fifos, 0 = calloc()
+    const struct voice_processing_backend *backend;     // active backend
+    SpeexEchoState *echo_state;
+    SpeexPreprocessState *preprocess_state;
+    s16 *near_fifo;             // near samples not yet cancelled
+    s16 *far_fifo;              // far samples not yet cancelled
+    s16 *out_fifo;              // cancelled samples not yet taken
+    int in_size;                // bytes of near_fifo and far_fifo
+    int out_size;               // bytes of out_fifo
+    int in_fill;                // frames in near_fifo and far_fifo
+    int out_fill;               // frames in out_fifo
+    long long busy_us;          // processing time in this auto_tail interval
+    int busy_periods;           // periods in this auto_tail interval
+    struct walkie_talkie wt;
+    struct voice_level level[2];        // LEVEL_DOWNLINK and LEVEL_UPLINK
+    struct voice_activity far_activity;
+    unsigned int vad_frames;    // frames seen with vad on since reset
+    unsigned int vad_bypassed;  // of them passed as is, far end silent
+    int swap;                   // SWAP_*, atomic
+    const struct voice_processing_backend *want_backend;        // atomic
+    int want_tail;              // asked by auto_tail, -1 = failed, atomic
+    const struct voice_processing_backend *spare_backend;
+    SpeexEchoState *spare_echo_state;
+    SpeexPreprocessState *spare_preprocess_state;
+    int spare_tail;
+    int spare_frame_size;       // frame spare state was built for
+};
+
+/* With arena, vp must be zeroed or destroyed before. Fifos can't be given
+   back to arena, so destroy keeps them and next init with the same arena
+   reuses them if they are big enough, e.g. for the next call in daemon
+   mode. */
+int voice_processing_init(struct voice_processing *vp, int period_size,
+                          const struct voice_processing_config *config,
+                          struct arena *arena,
+                          void (*log)(const char *fmt, ...));
+
+/* Bytes voice_processing_init() takes from arena */
+size_t voice_processing_memory(int period_size,
+                               const struct voice_processing_config *config);
+void voice_processing_reset(struct voice_processing *vp, int keep);
+void voice_processing_destroy(struct voice_processing *vp);
+
+/* Process one uplink period. near is what was recorded by microphone, far is
+   the echo reference (what was played on speaker) and out is what we send to
+   umts. Far can be modified. Returns walkie talkie ECHO_* state or -1 if
+   there is none. */
+int voice_processing_uplink(struct voice_processing *vp, const s16 *near,
+                            s16 *far, s16 *out);
+
+/* Level stages of one downlink period, buf is what will be played */
+void voice_processing_downlink(struct voice_processing *vp, s16 *buf);
+
+/* Process playback and record period together, volume of both can be
+   adjusted. Only for backends with duplex, returns ECHO_* or -1 if the
+   backend has none. Playback should already be through
+   voice_processing_downlink(). */
+int voice_processing_duplex(struct voice_processing *vp, s16 *playback,
+                            s16 *record);
+
+/* Backend with given name, 0 or "" is DEFAULT_BACKEND, 0 if unknown */
+const struct voice_processing_backend *voice_processing_find(const char *name);
+
+/* Switch to backend with given name, its state starts from scratch. If it
+   can't be created, "none" is used and -1 returned. */
+int voice_processing_select(struct voice_processing *vp, const char *name);
+
+/* Switching during a call. Request stores the wanted backend (any thread),
+   maintain builds its state (normal priority thread, must not run together
+   with init/select/destroy) and swap puts it in use at period boundary
+   (routing thread, never allocates). If the state can't be built, the
+   current backend is kept. */
+void voice_processing_request(struct voice_processing *vp,
+                              const struct voice_processing_backend *backend);
+void voice_processing_maintain(struct voice_processing *vp);
+void voice_processing_swap(struct voice_processing *vp);
+
+#endif